@@ -21,9 +21,10 @@ static uint32_t diff_mbit(uint64_t bytes_new, uint64_t bytes_old, uint64_t pkts_
 		+ diff_mpps(pkts_new, pkts_old, nanos) * 20 * 8);
 }
 
-BasicDev::BasicDev(std::string pci_addr,uint8_t max_bar_index):
+BasicDev::BasicDev(std::string pci_addr,uint8_t max_bar_index, int container_fd):
 m_basic_para()
 {
+    m_fds.container_fd = container_fd;
     // initialize struct members in the constructor body
     m_basic_para.pci_addr = pci_addr;
     m_basic_para.num_rx_queues = 0;
@@ -33,6 +34,25 @@ m_basic_para()
     for (auto& addr : m_basic_para.p_bar_addr) {
         addr = nullptr;
     }
+    // DMA memory of this device is allocated on this node
+    m_basic_para.numa_node = readNumaNode("/sys/bus/pci/devices/" + pci_addr);
+    info("device %s is attached to NUMA node %d", pci_addr.c_str(), m_basic_para.numa_node);
+}
+
+int BasicDev::readNumaNode(const std::string& dev_dir){
+    std::string path = dev_dir + "/numa_node";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        warn("failed to open %s, NUMA node unknown", path.c_str());
+        return -1;
+    }
+    int numa_node = -1;
+    // the kernel reports -1 on single node systems and if the firmware does not tell
+    if (fscanf(fp, "%d", &numa_node) != 1) {
+        numa_node = -1;
+    }
+    fclose(fp);
+    return numa_node;
 }
 
 
@@ -9,6 +9,11 @@
 #include <linux/vfio.h>
 
 #define MOVING_AVERAGE_RANGE 5
+// hybrid rx: a queue busy polls above the first packet rate and waits for interrupts again below the second
+#define HYBRID_POLL_ABOVE_PPS 100000
+#define HYBRID_IRQ_BELOW_PPS 20000
+// a busy polling queue reads the clock once per HYBRID_CHECK_MASK + 1 bursts
+#define HYBRID_CHECK_MASK 0x3F
 #define IRQ_SET_BUF_LEN (sizeof(struct vfio_irq_set) + sizeof(int))
 #define MAX_INTERRUPT_VECTORS 32
 #define MSIX_IRQ_SET_BUF_LEN (sizeof(struct vfio_irq_set) + sizeof(int) * (MAX_INTERRUPT_VECTORS + 1))
@@ -24,14 +29,30 @@ struct DevStatus {
     uint64_t    rx_bytes;
     uint64_t    tx_bytes;
 };
-// this struct is used for dynamic interrupt moderation
-// to be used in the future.
+// moving average of the packet rate of a queue in packets per second, one sample per check interval.
+// drives the switch between interrupts and busy polling of the hybrid rx mode
 struct interrupt_moving_avg {
 	uint32_t index; // The current index
 	uint32_t length; // The moving average length
 	uint64_t sum; // The moving average sum
 	uint64_t measured_rates[MOVING_AVERAGE_RANGE]; // The moving average window
 };
+// latency ranges of the dynamic interrupt throttling, as in the linux ixgbe driver
+enum itr_latency_range : uint8_t {
+	ITR_LOWEST_LATENCY = 0, // few bytes per us, every interrupt right away
+	ITR_LOW_LATENCY = 1,
+	ITR_BULK_LATENCY = 2, // many bytes per us, few interrupts
+};
+// state of the dynamic interrupt throttling of one queue
+struct itr_state {
+	uint8_t latency_range{ITR_LOW_LATENCY}; // current itr_latency_range
+	uint32_t itr{0}; // current throttling interval in EITR units (~0.25 us), 0 is no throttling
+	uint64_t last_update{0}; // monotonic time of the last update
+	uint64_t rx_pkts{0}; // ring counters at the last update
+	uint64_t rx_bytes{0};
+	uint64_t bytes_per_us{0}; // rate measured by the last update
+	uint64_t changes{0}; // EITR writes so far
+};
 // interrupt queue structure
 struct InterruptQueue {
 	int vfio_event_fd; // event fd
@@ -43,6 +64,9 @@ struct InterruptQueue {
 	uint64_t interval; // The interval to check the interrupt flag
     uint32_t  timeout_ms{100}; // interrupt timeout in milliseconds
 	struct interrupt_moving_avg moving_avg; // The moving average of the hybrid interrupt
+	uint64_t mode_switches{0}; // switches between interrupts and busy polling so far
+	bool batch_full{false}; // the last read filled the whole batch, more packets are likely waiting
+	struct itr_state itr; // dynamic interrupt throttling, see interruptPara::dynamic_itr
 };
 struct basic_para_type{
 	std::string   pci_addr; //the pci address you can find in lspci
@@ -50,6 +74,7 @@ struct basic_para_type{
 	uint16_t   num_rx_queues; // the number of rx queues
 	uint16_t   num_tx_queues;
     uint16_t   interrupt_timeout_ms; 
+    int        numa_node; // NUMA node the device is attached to, -1 if unknown
     std::array<uint8_t*,6>      p_bar_addr; // the BAR address
     MacAddress            mac_address;
 };
@@ -63,13 +88,18 @@ struct VfioFd{
 
 struct interruptPara{
     uint32_t  itr_rate{0x028}; // interrupt throttling rate. Default is 
+    uint64_t  poll_above_pps{HYBRID_POLL_ABOVE_PPS}; // hybrid rx hysteresis, see HYBRID_POLL_ABOVE_PPS
+    uint64_t  irq_below_pps{HYBRID_IRQ_BELOW_PPS};
+    bool      dynamic_itr{false}; // retune the throttling of every queue from its byte rate instead of itr_rate
     std::vector<InterruptQueue>   interrupt_queues;
     uint8_t   interrupt_type; // MSI or MSIX currently
 };
 
 class BasicDev{
     public:
-           BasicDev(std::string pci_addr,uint8_t max_bar_index )            ;
+        // pass the container fd of another device to put this device into the same VFIO container,
+        // both then share one IOVA space and one DMAMemoryAllocator
+           BasicDev(std::string pci_addr,uint8_t max_bar_index, int container_fd = -1);
         virtual             ~BasicDev()   = default                         ;
         virtual bool        initHardware()  = 0 ;
         virtual bool        initializeInterrupt(const int interrupt_interval, const uint32_t timeout_ms) = 0 ;
@@ -87,6 +117,10 @@ class BasicDev{
                                         size_t size, 
                                         uint16_t queue_id)              = 0 ;
         basic_para_type     get_basic_para()                                ;
+        int                 getNumaNode() const { return m_basic_para.numa_node; }
+        int                 getContainerFD() const { return m_fds.container_fd; }
+        // reads <dev_dir>/numa_node, e.g. dev_dir = /sys/bus/pci/devices/0000:04:00.0
+        static int          readNumaNode(const std::string& dev_dir)        ;
     protected:
         // Common VFIO setup functions (shared by all PCIe drivers)
         bool                _getFD()                                        ;
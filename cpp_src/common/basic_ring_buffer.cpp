@@ -3,14 +3,28 @@
 #include "log.h"
 #include "ixgbe_type.h"
 #include <cstring>
+RingBuffer::~RingBuffer(){
+	// the linked memory pool is owned by the device, only the descriptor memory belongs to the ring
+	if (m_desc_mem_pair.virt) {
+		DMAMemoryAllocator::getInstance(m_container_fd).freeDMAMemory(m_desc_mem_pair);
+		m_desc_mem_pair = {nullptr, 0, 0};
+	}
+	if (a_linked_buf_addr) {
+		delete[] a_linked_buf_addr;
+		a_linked_buf_addr = nullptr;
+	}
+}
+
 //This function allocate DMA memory for descriptors, whose number of elements is as same as the linked memory pool
-bool RingBuffer::_allocDescMemory(int container_fd, uint32_t num_desc, uint32_t size_desc){
+bool RingBuffer::_allocDescMemory(int container_fd, uint32_t num_desc, uint32_t size_desc, int numa_node, const std::string& owner){
     if (p_mem_pool == nullptr) {
         error("No memory pool linked yet");
         return false;
     }
 	uint32_t total_size = num_desc * size_desc;
-	DMAMemoryPair desc_mem_pair = DMAMemoryAllocator::getInstance().allocDMAMemory(total_size, container_fd);
+	// descriptor ring base addresses only need 128 byte alignment, so rings of several queues can share one huge page
+	m_container_fd = container_fd;
+	DMAMemoryPair desc_mem_pair = DMAMemoryAllocator::getInstance(container_fd).allocDMAMemory(total_size, 128, numa_node, owner);
 	memset(desc_mem_pair.virt, -1, total_size);
 	m_desc_mem_pair = desc_mem_pair;
 	return true;
@@ -20,10 +34,12 @@ bool RingBuffer::_allocDescMemory(int container_fd, uint32_t num_desc, uint32_t
 
 
 
-bool RingBuffer::createDescriptorRing(int container_fd, uint8_t* BAR_addr, uint32_t num_desc, uint32_t size_desc, uint8_t ring_index){
+bool RingBuffer::createDescriptorRing(int container_fd, uint8_t* BAR_addr, uint32_t num_desc, uint32_t size_desc, uint8_t ring_index, int numa_node,
+                                      const std::string& owner){
 	m_num_desc = num_desc;
 	m_size_desc = size_desc;
-	this->_allocDescMemory(container_fd, num_desc, size_desc);
+	m_ring_index = ring_index;
+	this->_allocDescMemory(container_fd, num_desc, size_desc, numa_node, owner);
 	this->_bindDescMemIOVA(BAR_addr, ring_index);
 	this->_bindDescMemVirt();
 	if (!a_linked_buf_addr) {
@@ -9,11 +9,14 @@
 
 class RingBuffer{
     public:
-        virtual         ~RingBuffer() = default;
+        virtual         ~RingBuffer();
         virtual bool    linkMemoryPool( DMAMemoryPool* const mem_pool) = 0;
-        bool            createDescriptorRing(int container_fd, uint8_t* BAR_addr,uint32_t num_desc, uint32_t size_desc, uint8_t ring_index);
+        bool            createDescriptorRing(int container_fd, uint8_t* BAR_addr,uint32_t num_desc, uint32_t size_desc, uint8_t ring_index, int numa_node = -1,
+                                             const std::string& owner = "");
+        // port id stamped into every received pkt_buf
+        void            setPortId(uint16_t port_id) { m_port_id = port_id; }
     protected:
-        bool            _allocDescMemory(int container_fd, uint32_t num_desc, uint32_t size_desc);
+        bool            _allocDescMemory(int container_fd, uint32_t num_desc, uint32_t size_desc, int numa_node, const std::string& owner);
         virtual bool    _bindDescMemIOVA(uint8_t* BAR_addr, uint8_t ring_index) = 0;
         virtual bool    _bindDescMemVirt() = 0;
     protected:
@@ -21,10 +24,17 @@ class RingBuffer{
         uint32_t        m_num_buf{0};
         uint32_t        m_num_desc{0}    ;
         DMAMemoryPool*  p_mem_pool{nullptr};
-        DMAMemoryPair   m_desc_mem_pair{0,0,0};  
+        // descriptors take pkt_buf::getData() (the buffer plus data_off) directly as device address if the pool is
+        // mapped IOVA == VA, otherwise getDataIOVA()
+        bool            m_iova_is_va{false};
+        DMAMemoryPair   m_desc_mem_pair{0,0,0};
+        // container the descriptor memory is mapped into
+        int             m_container_fd{-1};  
         pkt_buf**       a_linked_buf_addr{nullptr}; // one-on-one to descriptors
         uint16_t        m_desc_head{0}        ; // used descriptor start index
         uint16_t        m_desc_tail{0}        ; // used descriptor end index
+        uint16_t        m_ring_index{0}       ; // queue number on the device
+        uint16_t        m_port_id{0}          ;
 
 
 };
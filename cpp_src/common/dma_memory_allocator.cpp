@@ -1,55 +1,745 @@
 #include "dma_memory_allocator.h"
 #include <unistd.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <linux/mman.h>
 #include <linux/vfio.h>
 #include "log.h"
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <string>
+#include <algorithm>
 
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+constexpr uint64_t  iova_start       = 0x10000;
 constexpr uint64_t  iova_end         = UINT64_MAX;
+constexpr size_t    huge_page_2mb    = 2ull*1024*1024;
+constexpr size_t    huge_page_1gb    = 1ull*1024*1024*1024;
 
 
-DMAMemoryAllocator::DMAMemoryAllocator()
+RangeAllocator::RangeAllocator(uint64_t start, uint64_t end)
 {
+    if (end > start) {
+        m_free_ranges[start] = end - start;
+    }
+}
+
+bool RangeAllocator::allocRange(uint64_t size, uint64_t alignment, uint64_t* p_start){
+    for (auto it = m_free_ranges.begin(); it != m_free_ranges.end(); ++it) {
+        uint64_t range_start = it->first;
+        uint64_t range_size  = it->second;
+        uint64_t start = alignment ? (range_start + alignment - 1) & ~(alignment - 1) : range_start;
+        if (start < range_start || start - range_start + size > range_size) {
+            continue;
+        }
+        // split the free range into the part in front of and the part behind the allocation
+        uint64_t front = start - range_start;
+        uint64_t back  = range_size - front - size;
+        m_free_ranges.erase(it);
+        if (front) {
+            m_free_ranges[range_start] = front;
+        }
+        if (back) {
+            m_free_ranges[start + size] = back;
+        }
+        *p_start = start;
+        return true;
+    }
+    return false;
+}
+
+void RangeAllocator::freeRange(uint64_t start, uint64_t size){
+    if (!size) return;
+    auto next = m_free_ranges.lower_bound(start);
+    auto prev = (next != m_free_ranges.begin()) ? std::prev(next) : m_free_ranges.end();
+    if ((next != m_free_ranges.end() && next->first < start + size) ||
+        (prev != m_free_ranges.end() && prev->first + prev->second > start)) {
+        warn("range 0x%llx+0x%llx overlaps a free range, possible double free",
+             (unsigned long long) start, (unsigned long long) size);
+        return;
+    }
+    // merge with the following range
+    if (next != m_free_ranges.end() && next->first == start + size) {
+        size += next->second;
+        m_free_ranges.erase(next);
+    }
+    // merge with the preceding range
+    if (prev != m_free_ranges.end() && prev->first + prev->second == start) {
+        prev->second += size;
+        return;
+    }
+    m_free_ranges[start] = size;
+}
+
+bool RangeAllocator::reserveRange(uint64_t start, uint64_t size){
+    auto it = m_free_ranges.upper_bound(start);
+    if (it == m_free_ranges.begin()) return false;
+    --it;
+    uint64_t range_start = it->first;
+    uint64_t range_size  = it->second;
+    if (start - range_start + size > range_size) {
+        return false;
+    }
+    uint64_t front = start - range_start;
+    uint64_t back  = range_size - front - size;
+    m_free_ranges.erase(it);
+    if (front) {
+        m_free_ranges[range_start] = front;
+    }
+    if (back) {
+        m_free_ranges[start + size] = back;
+    }
+    return true;
+}
+
+uint64_t RangeAllocator::getFreeBytes() const{
+    uint64_t free_bytes = 0;
+    for (const auto& range : m_free_ranges) {
+        free_bytes += range.second;
+    }
+    return free_bytes;
+}
+
+uint64_t RangeAllocator::getLargestFreeRange() const{
+    uint64_t largest = 0;
+    for (const auto& range : m_free_ranges) {
+        largest = std::max(largest, range.second);
+    }
+    return largest;
+}
+
+
+DMAMemoryAllocator::DMAMemoryAllocator(int container_fd):
+    m_container_fd(container_fd),
+    m_iova_ranges(iova_start, iova_end)
+{
+}
+
+std::map<int, std::unique_ptr<DMAMemoryAllocator>>& DMAMemoryAllocator::_instances(){
+    static std::map<int, std::unique_ptr<DMAMemoryAllocator>> instances;
+    return instances;
+}
+
+DMAMemoryAllocator& DMAMemoryAllocator::getInstance(int container_fd){
+    auto& instance = _instances()[container_fd];
+    if (!instance) {
+        instance.reset(new DMAMemoryAllocator(container_fd));
+    }
+    return *instance;
+}
+
+bool DMAMemoryAllocator::releaseInstance(int container_fd){
+    auto it = _instances().find(container_fd);
+    if (it == _instances().end()) {
+        return false;
+    }
+    _instances().erase(it);
+    return true;
 }
 
 DMAMemoryAllocator::~DMAMemoryAllocator()
 {
+    _unmapIOVirtualAddr();
+    _unmapVirtualAddr();
 }
 
-DMAMemoryPair DMAMemoryAllocator::allocDMAMemory(size_t size, int container_fd){
-    size = _alignUpU64(size, m_page_size);
-    // allocate IO virtual address aligned to page size to avoid overlap across mappings
-    uint64_t iova = _alignUpU64(m_next_iova, m_page_size);
-    if (iova > iova_end || iova + size - 1 > iova_end) {
-        error("IOMMU aperture exhausted: need 0x%llx bytes", (unsigned long long) size);
-        exit(EXIT_FAILURE);
+DMAMemoryPair DMAMemoryAllocator::allocDMAMemory(size_t size, size_t alignment, int numa_node, const std::string& owner){
+    if (alignment & (alignment - 1)) {
+        error("DMA alignment 0x%zx is not a power of two", alignment);
+    }
+    DMAMemoryPair DMA_mem_pair;
+    // requests that do not fit into one arena still get their own huge pages
+    bool in_arena = m_arena_mode && _alignUpU64(size, alignment) <= m_arena_size;
+    if (in_arena) {
+        DMA_mem_pair = _carveFromArena(size, alignment, numa_node);
+    } else {
+        DMA_mem_pair = _mapRegion(size, numa_node);
     }
+    m_allocations[DMA_mem_pair.iova] = {DMA_mem_pair, owner, in_arena, false};
+    m_total_allocs++;
+    return DMA_mem_pair;
+}
+
+bool DMAMemoryAllocator::freeDMAMemory(const DMAMemoryPair& DMA_mem_pair){
+    if (!DMA_mem_pair.virt) {
+        return false;
+    }
+    if (!m_allocations.erase(DMA_mem_pair.iova)) {
+        // a double free or a stale pair, touching the arena would drop the live count of memory still in use
+        warn("no DMA allocation found at iova 0x%llx", (unsigned long long) DMA_mem_pair.iova);
+        return false;
+    }
+    m_total_frees++;
+    for (auto it = m_arenas.begin(); it != m_arenas.end(); ++it) {
+        uint64_t offset = DMA_mem_pair.iova - it->region.iova;
+        if (DMA_mem_pair.iova < it->region.iova || offset >= it->region.size) continue;
+        it->offsets.freeRange(offset, DMA_mem_pair.size);
+        if (--it->num_live == 0) {
+            // last user of the arena is gone, give the huge pages back
+            uint64_t region_iova = it->region.iova;
+            m_arenas.erase(it);
+            return _unmapRegion(region_iova);
+        }
+        return true;
+    }
+    return _unmapRegion(DMA_mem_pair.iova);
+}
+
+void DMAMemoryAllocator::setArenaMode(bool enable, size_t arena_size){
+    m_arena_mode = enable;
+    // arenas are mapped as a whole, so they must consist of full huge pages
+    m_arena_size = _alignUpU64(arena_size, m_page_size);
+}
+
+// maps a dedicated huge-page region into the IOMMU
+DMAMemoryPair DMAMemoryAllocator::_mapRegion(size_t size, int numa_node){
+    if (isFileBacking()) {
+        return _mapFileRegion(size, numa_node);
+    }
+    size_t page_size = _choosePageSize(size, numa_node);
     //allocate virtual address
-    void* virt_addr = _allocDMAVirtualAddr(size);
-    _bindIOVAWithVirtAddr(virt_addr, iova, size, container_fd);
-    // advance for next allocation
-    m_next_iova = iova + size;
+    void* virt_addr = _allocDMAVirtualAddr(_alignUpU64(size, page_size), page_size);
+    if (!virt_addr && page_size != m_page_size) {
+        // 1GB pages may be taken between reading the counter and mmap(), fall back to 2MB pages
+        warn("no %zu MB huge page left, falling back to %llu MB pages", page_size >> 20, (unsigned long long) m_page_size >> 20);
+        page_size = m_page_size;
+        virt_addr = _allocDMAVirtualAddr(_alignUpU64(size, page_size), page_size);
+    }
+    if (!virt_addr) {
+        error("Failed to mmap 0x%zx bytes of DMA memory using huge page, %llu x 2MB pages free on node %d. "
+              "Huge page may have not been enabled. The error code is %s", size,
+              (unsigned long long) _getFreeHugePages(m_page_size, numa_node), numa_node, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    size = _alignUpU64(size, page_size);
+    uint64_t iova = _allocIOVA(virt_addr, size, page_size);
+    // the policy has to be in place before the pages are faulted in, which VFIO_IOMMU_MAP_DMA does when pinning them
+    if (numa_node >= 0) {
+        _bindToNumaNode(virt_addr, size, numa_node);
+    }
+    if (m_warm_start) {
+        _populateRegion(virt_addr, size);
+    }
+    _bindIOVAWithVirtAddr(virt_addr, iova, size);
     DMAMemoryPair DMA_mem_pair;
     DMA_mem_pair.virt = virt_addr;
     DMA_mem_pair.iova = iova;
     DMA_mem_pair.size = size;
-    m_allocated_memories.push_back(DMA_mem_pair);
+    DMA_mem_pair.page_size = page_size;
+    DMA_mem_pair.numa_node = _getNumaNodeOfAddr(virt_addr);
+    if (numa_node >= 0 && DMA_mem_pair.numa_node != numa_node) {
+        warn("DMA memory at iova 0x%llx landed on NUMA node %d instead of %d", (unsigned long long) iova, DMA_mem_pair.numa_node, numa_node);
+    }
+    m_allocated_memories.push_back({DMA_mem_pair});
+    debug("mapped 0x%zx bytes at iova 0x%llx using %zu MB pages", size, (unsigned long long) iova, page_size >> 20);
     return  DMA_mem_pair;
 }
 
-void*  DMAMemoryAllocator::_allocDMAVirtualAddr(size_t size){
+// allocate IO virtual address aligned to page size to avoid overlap across mappings and to let the IOMMU
+// use a superpage entry for it, ranges of released mappings are reused first.
+// in IOVA == VA mode the virtual address itself is taken out of the IOVA space instead
+uint64_t DMAMemoryAllocator::_allocIOVA(void* virt_addr, size_t size, size_t alignment){
+    uint64_t iova = 0;
+    if (m_iova_equal_va) {
+        iova = (uint64_t) virt_addr;
+        if (!m_iova_ranges.reserveRange(iova, size)) {
+            error("IOVA 0x%llx+0x%zx is already mapped or outside the IOMMU aperture, cannot map it IOVA == VA",
+                  (unsigned long long) iova, size);
+            exit(EXIT_FAILURE);
+        }
+        return iova;
+    }
+    if (!m_iova_ranges.allocRange(size, alignment, &iova)) {
+        error("IOMMU aperture exhausted: need 0x%llx bytes", (unsigned long long) size);
+        exit(EXIT_FAILURE);
+    }
+    return iova;
+}
+
+DMAMemoryPair DMAMemoryAllocator::registerExternalMemory(void* virt, size_t size, const std::string& owner){
+    DMAMemoryPair DMA_mem_pair = _mapExternal(virt, size, nullptr);
+    m_allocations[DMA_mem_pair.iova] = {DMA_mem_pair, owner, false, true};
+    m_total_allocs++;
+    return DMA_mem_pair;
+}
+
+DMAMemoryPair DMAMemoryAllocator::importDMAMemory(const DMAMemoryPair& DMA_mem_pair, const std::string& owner){
+    // keeping the IOVA lets a descriptor built for one container be handed to a device of the other one
+    DMAMemoryPair imported_pair = _mapExternal(DMA_mem_pair.virt, DMA_mem_pair.size, &DMA_mem_pair.iova);
+    imported_pair.page_size = DMA_mem_pair.page_size;
+    imported_pair.numa_node = DMA_mem_pair.numa_node;
+    m_allocations[imported_pair.iova] = {imported_pair, owner, false, true};
+    m_total_allocs++;
+    return imported_pair;
+}
+
+// maps caller-owned memory, at *p_iova_hint if that range is still free
+DMAMemoryPair DMAMemoryAllocator::_mapExternal(void* virt, size_t size, const uint64_t* p_iova_hint){
+    // the IOMMU maps whole 4kB pages
+    uint64_t map_start = (uint64_t) virt & ~4095ull;
+    size_t   map_size  = _alignUpU64((uint64_t) virt + size, 4096) - map_start;
+    uint64_t iova = 0;
+    uint64_t hint_start = p_iova_hint ? *p_iova_hint - ((uint64_t) virt - map_start) : 0;
+    if (p_iova_hint && !m_iova_equal_va && m_iova_ranges.reserveRange(hint_start, map_size)) {
+        iova = hint_start;
+    } else {
+        iova = _allocIOVA((void*) map_start, map_size, 4096);
+    }
+    _bindIOVAWithVirtAddr((void*) map_start, iova, map_size);
+    DMAMemoryPair mapped_pair;
+    mapped_pair.virt = (void*) map_start;
+    mapped_pair.iova = iova;
+    mapped_pair.size = map_size;
+    mapped_pair.numa_node = _getNumaNodeOfAddr(virt);
+    m_allocated_memories.push_back({mapped_pair, true});
+    DMAMemoryPair DMA_mem_pair = mapped_pair;
+    DMA_mem_pair.virt = virt;
+    DMA_mem_pair.iova = iova + ((uint64_t) virt - map_start);
+    DMA_mem_pair.size = size;
+    return DMA_mem_pair;
+}
+
+DMAAllocatorStats DMAMemoryAllocator::getStats() const{
+    DMAAllocatorStats stats = {};
+    for (const auto& mapping : m_allocated_memories) {
+        stats.num_mappings++;
+        stats.mapped_bytes += mapping.pair.size;
+    }
+    for (const auto& arena : m_arenas) {
+        stats.num_arenas++;
+        stats.arena_free_bytes += arena.offsets.getFreeBytes();
+        stats.arena_largest_free = std::max(stats.arena_largest_free, arena.offsets.getLargestFreeRange());
+    }
+    for (const auto& allocation : m_allocations) {
+        stats.live_allocs++;
+        stats.live_bytes += allocation.second.pair.size;
+    }
+    stats.total_allocs = m_total_allocs;
+    stats.total_frees  = m_total_frees;
+    stats.hugepage_free_2mb = _getFreeHugePages(huge_page_2mb, -1);
+    stats.hugepage_free_1gb = _getFreeHugePages(huge_page_1gb, -1);
+    stats.reattached_regions = m_reattached_regions;
+    return stats;
+}
+
+std::vector<DMAAllocationInfo> DMAMemoryAllocator::getAllocations() const{
+    std::vector<DMAAllocationInfo> allocations;
+    allocations.reserve(m_allocations.size());
+    for (const auto& allocation : m_allocations) {
+        allocations.push_back(allocation.second);
+    }
+    return allocations;
+}
+
+std::vector<DMAMemoryPair> DMAMemoryAllocator::getMappings() const{
+    std::vector<DMAMemoryPair> mappings;
+    mappings.reserve(m_allocated_memories.size());
+    for (const auto& mapping : m_allocated_memories) {
+        mappings.push_back(mapping.pair);
+    }
+    return mappings;
+}
+
+void DMAMemoryAllocator::dump(FILE* fp) const{
+    DMAAllocatorStats stats = getStats();
+    fprintf(fp, "DMA memory of container %d\n", m_container_fd);
+    fprintf(fp, "  mappings:\n");
+    for (const auto& mapping : m_allocated_memories) {
+        fprintf(fp, "    virt %p iova 0x%012llx size %10zu page %4zuMB node %2d%s\n",
+                mapping.pair.virt, (unsigned long long) mapping.pair.iova, mapping.pair.size,
+                mapping.pair.page_size >> 20, mapping.pair.numa_node, mapping.external ? " external" : "");
+    }
+    fprintf(fp, "  allocations:\n");
+    for (const auto& allocation : m_allocations) {
+        const DMAAllocationInfo& info = allocation.second;
+        fprintf(fp, "    virt %p iova 0x%012llx size %10zu page %4zuMB node %2d %-7s %s\n",
+                info.pair.virt, (unsigned long long) info.pair.iova, info.pair.size, info.pair.page_size >> 20,
+                info.pair.numa_node, info.in_arena ? "arena" : (info.external ? "extern" : "own"),
+                info.owner.empty() ? "-" : info.owner.c_str());
+    }
+    fprintf(fp, "  %llu mappings, %llu bytes mapped, %llu arenas with %llu bytes free (largest %llu)\n",
+            (unsigned long long) stats.num_mappings, (unsigned long long) stats.mapped_bytes,
+            (unsigned long long) stats.num_arenas, (unsigned long long) stats.arena_free_bytes,
+            (unsigned long long) stats.arena_largest_free);
+    fprintf(fp, "  %llu allocations alive with %llu bytes, %llu allocated and %llu released in total\n",
+            (unsigned long long) stats.live_allocs, (unsigned long long) stats.live_bytes,
+            (unsigned long long) stats.total_allocs, (unsigned long long) stats.total_frees);
+    fprintf(fp, "  huge pages left: %llu x 2MB, %llu x 1GB\n",
+            (unsigned long long) stats.hugepage_free_2mb, (unsigned long long) stats.hugepage_free_1gb);
+    if (!m_backing_dir.empty()) {
+        fprintf(fp, "  backed by %s/%s_*, %llu regions re-attached\n", m_backing_dir.c_str(), m_backing_prefix.c_str(),
+                (unsigned long long) stats.reattached_regions);
+    }
+}
+
+uint64_t DMAMemoryAllocator::getHugePageHeadroom(size_t page_size, int numa_node){
+    return _getFreeHugePages(page_size, numa_node) * page_size;
+}
+
+bool DMAMemoryAllocator::setFileBacking(const std::string& dir, const std::string& prefix){
+    if (dir.empty()) {
+        m_backing_dir.clear();
+        return true;
+    }
+    size_t page_size = _getHugetlbfsPageSize(dir);
+    if (!page_size) {
+        warn("%s is not a hugetlbfs mount, keeping anonymous DMA memory", dir.c_str());
+        return false;
+    }
+    m_backing_dir = dir;
+    m_backing_prefix = prefix;
+    m_backing_page_size = page_size;
+    m_num_file_regions = 0;
+    m_free_region_indices.clear();
+    return true;
+}
+
+bool DMAMemoryAllocator::removeBackingFiles(const std::string& dir, const std::string& prefix){
+    DIR* p_dir = opendir(dir.c_str());
+    if (!p_dir) {
+        warn("Failed to open %s: %s", dir.c_str(), strerror(errno));
+        return false;
+    }
+    bool ret = true;
+    std::string file_prefix = prefix + "_";
+    while (struct dirent* entry = readdir(p_dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, file_prefix.size(), file_prefix) != 0) continue;
+        if (unlink((dir + "/" + name).c_str()) == -1) {
+            warn("Failed to remove backing file %s: %s", name.c_str(), strerror(errno));
+            ret = false;
+        }
+    }
+    closedir(p_dir);
+    return ret;
+}
+
+// huge page size of the hugetlbfs mounted at dir, 0 if dir is no hugetlbfs
+size_t DMAMemoryAllocator::_getHugetlbfsPageSize(const std::string& dir){
+    struct statfs fs_info = {};
+    if (statfs(dir.c_str(), &fs_info) == -1 || fs_info.f_type != HUGETLBFS_MAGIC) {
+        return 0;
+    }
+    return fs_info.f_bsize;
+}
+
+// looks for <prefix>_<region_index>_<iova in hex> left behind by an earlier run
+bool DMAMemoryAllocator::_findBackingFile(uint32_t region_index, std::string* p_name, uint64_t* p_iova){
+    DIR* p_dir = opendir(m_backing_dir.c_str());
+    if (!p_dir) {
+        return false;
+    }
+    std::string file_prefix = m_backing_prefix + "_" + std::to_string(region_index) + "_";
+    bool found = false;
+    while (struct dirent* entry = readdir(p_dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, file_prefix.size(), file_prefix) != 0) continue;
+        const char* p_iova_str = name.c_str() + file_prefix.size();
+        char* p_end = nullptr;
+        uint64_t iova = strtoull(p_iova_str, &p_end, 16);
+        // skips files of a run that died before naming them
+        if (p_end == p_iova_str || *p_end != '\0') continue;
+        *p_name = name;
+        *p_iova = iova;
+        found = true;
+        break;
+    }
+    closedir(p_dir);
+    return found;
+}
+
+// maps a region backed by a named hugetlbfs file. if an earlier run left the file of this region behind, its pages
+// (and their content) are taken over and the region gets the same IOVA again, so no huge page has to be zeroed.
+// the file name carries the IOVA, it is renamed once a new IOVA is chosen
+DMAMemoryPair DMAMemoryAllocator::_mapFileRegion(size_t size, int numa_node){
+    size_t page_size = m_backing_page_size;
+    size = _alignUpU64(size, page_size);
+    uint32_t region_index;
+    if (!m_free_region_indices.empty()) {
+        region_index = *m_free_region_indices.begin();
+        m_free_region_indices.erase(m_free_region_indices.begin());
+    } else {
+        region_index = m_num_file_regions++;
+    }
+    std::string name;
+    uint64_t iova = 0;
+    bool reattached = false;
+    if (_findBackingFile(region_index, &name, &iova)) {
+        struct stat file_stat;
+        std::string old_path = m_backing_dir + "/" + name;
+        if (stat(old_path.c_str(), &file_stat) == 0 && (uint64_t) file_stat.st_size == size &&
+            m_iova_ranges.reserveRange(iova, size)) {
+            reattached = true;
+        } else {
+            warn("backing file %s does not fit the request anymore, recreating it", old_path.c_str());
+            unlink(old_path.c_str());
+        }
+    }
+    if (!reattached) {
+        name = m_backing_prefix + "_" + std::to_string(region_index) + "_new";
+    }
+    std::string path = m_backing_dir + "/" + name;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        error("Failed to open backing file %s: %s", path.c_str(), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!reattached && ftruncate(fd, size) == -1) {
+        error("Failed to size backing file %s to 0x%zx bytes: %s", path.c_str(), size, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    // warm start populates only after the NUMA policy is set, see below
+    int flags = MAP_SHARED;
+    bool keep_iova = reattached;
+    void* virt_addr = MAP_FAILED;
+    if (reattached && m_iova_equal_va) {
+        // IOVA == VA needs the old virtual address back as well
+        virt_addr = mmap((void*) iova, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED_NOREPLACE, fd, 0);
+        if (virt_addr != MAP_FAILED && virt_addr != (void*) iova) {
+            munmap(virt_addr, size);
+            virt_addr = MAP_FAILED;
+        }
+        if (virt_addr == MAP_FAILED) {
+            warn("virtual address 0x%llx is taken, re-attaching %s under a new IOVA", (unsigned long long) iova, name.c_str());
+            m_iova_ranges.freeRange(iova, size);
+            keep_iova = false;
+        }
+    }
+    if (virt_addr == MAP_FAILED) {
+        virt_addr = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    }
+    close(fd);
+    if (virt_addr == MAP_FAILED) {
+        error("Failed to mmap backing file %s (0x%zx bytes, %llu huge pages free): %s", path.c_str(), size,
+              (unsigned long long) _getFreeHugePages(page_size, numa_node), strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (!keep_iova) {
+        iova = _allocIOVA(virt_addr, size, page_size);
+        char new_name[256];
+        snprintf(new_name, sizeof(new_name), "%s_%u_%llx", m_backing_prefix.c_str(), region_index, (unsigned long long) iova);
+        std::string new_path = m_backing_dir + "/" + new_name;
+        if (rename(path.c_str(), new_path.c_str()) == -1) {
+            warn("Failed to rename backing file %s: %s", path.c_str(), strerror(errno));
+        } else {
+            path = new_path;
+        }
+    }
+    // pages of a re-attached file are already placed
+    if (!reattached && numa_node >= 0) {
+        _bindToNumaNode(virt_addr, size, numa_node);
+    }
+    if (m_warm_start) {
+        _populateRegion(virt_addr, size);
+    }
+    _bindIOVAWithVirtAddr(virt_addr, iova, size);
+    DMAMemoryPair DMA_mem_pair;
+    DMA_mem_pair.virt = virt_addr;
+    DMA_mem_pair.iova = iova;
+    DMA_mem_pair.size = size;
+    DMA_mem_pair.page_size = page_size;
+    DMA_mem_pair.numa_node = _getNumaNodeOfAddr(virt_addr);
+    if (!reattached && numa_node >= 0 && DMA_mem_pair.numa_node != numa_node) {
+        warn("DMA memory at iova 0x%llx landed on NUMA node %d instead of %d", (unsigned long long) iova, DMA_mem_pair.numa_node, numa_node);
+    }
+    m_allocated_memories.push_back({DMA_mem_pair, false, path, region_index});
+    if (reattached) {
+        m_reattached_regions++;
+        info("re-attached backing file %s at iova 0x%llx", name.c_str(), (unsigned long long) iova);
+    }
+    return DMA_mem_pair;
+}
+
+uint64_t DMAMemoryAllocator::getIOMMUPageSizes(){
+    if (m_iommu_page_sizes) {
+        return m_iommu_page_sizes;
+    }
+    struct vfio_iommu_type1_info iommu_info = {};
+    iommu_info.argsz = sizeof(iommu_info);
+    uint64_t page_sizes = m_page_size;
+    if (ioctl(m_container_fd, VFIO_IOMMU_GET_INFO, &iommu_info) == -1) {
+        warn("Failed to get IOMMU info, assuming 2MB pages only: %s", strerror(errno));
+    } else if (iommu_info.flags & VFIO_IOMMU_INFO_PGSIZES) {
+        page_sizes = iommu_info.iova_pgsizes;
+    }
+    m_iommu_page_sizes = page_sizes;
+    return page_sizes;
+}
+
+// picks the largest huge page size that the IOMMU can map, that has free pages left
+// and that does not waste more than half of the mapping when rounding up
+size_t DMAMemoryAllocator::_choosePageSize(size_t size, int numa_node){
+    uint64_t iommu_page_sizes = getIOMMUPageSizes();
+    for (size_t page_size : {huge_page_1gb, huge_page_2mb}) {
+        if (page_size == m_page_size) break;
+        if (!(iommu_page_sizes & page_size)) continue;
+        if (size < page_size / 2) continue;
+        if (_getFreeHugePages(page_size, numa_node) * page_size < _alignUpU64(size, page_size)) continue;
+        return page_size;
+    }
+    return m_page_size;
+}
+
+// free huge pages of the given size, counted on numa_node only if it is >= 0
+uint64_t DMAMemoryAllocator::_getFreeHugePages(size_t page_size, int numa_node){
+    std::string dir = (numa_node >= 0) ? "/sys/devices/system/node/node" + std::to_string(numa_node) + "/hugepages"
+                                       : std::string("/sys/kernel/mm/hugepages");
+    std::string path = dir + "/hugepages-" + std::to_string(page_size >> 10) + "kB/free_hugepages";
+    FILE* fp = fopen(path.c_str(), "r");
+    if (!fp) {
+        // this page size is not configured on this kernel
+        return 0;
+    }
+    unsigned long long free_pages = 0;
+    if (fscanf(fp, "%llu", &free_pages) != 1) {
+        free_pages = 0;
+    }
+    fclose(fp);
+    return free_pages;
+}
+
+// strictly binds the not yet faulted pages of the mapping to numa_node
+bool DMAMemoryAllocator::_bindToNumaNode(void* virt_addr, size_t size, int numa_node){
+    unsigned long node_mask[16] = {};
+    const unsigned long bits_per_long = 8 * sizeof(unsigned long);
+    if ((size_t) numa_node >= sizeof(node_mask) * 8) {
+        warn("NUMA node %d out of range", numa_node);
+        return false;
+    }
+    node_mask[numa_node / bits_per_long] = 1ul << (numa_node % bits_per_long);
+    if (syscall(SYS_mbind, virt_addr, size, MPOL_BIND, node_mask, sizeof(node_mask) * 8, MPOL_MF_STRICT) == -1) {
+        warn("Failed to bind DMA memory to NUMA node %d: %s", numa_node, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// node of the page backing virt_addr, the page must already be faulted in
+int DMAMemoryAllocator::_getNumaNodeOfAddr(void* virt_addr){
+    int node = -1;
+    if (syscall(SYS_get_mempolicy, &node, NULL, 0, virt_addr, MPOL_F_NODE | MPOL_F_ADDR) == -1) {
+        return -1;
+    }
+    return node;
+}
+
+// faults in and locks the whole mapping for warm start, called once the NUMA policy is in place
+void DMAMemoryAllocator::_populateRegion(void* virt_addr, size_t size){
+    if (madvise(virt_addr, size, MADV_POPULATE_WRITE) == -1) {
+        // MADV_POPULATE_WRITE needs linux 5.14, touch every page instead
+        for (size_t offset = 0; offset < size; offset += 4096) {
+            volatile uint8_t* p = (volatile uint8_t*) virt_addr + offset;
+            *p = *p;
+        }
+    }
+    if (mlock(virt_addr, size) == -1) {
+        warn("Failed to mlock DMA memory at %p: %s", virt_addr, strerror(errno));
+    }
+}
+
+// undoes _mapRegion for the mapping starting at iova, or registerExternalMemory for the mapping containing it
+bool DMAMemoryAllocator::_unmapRegion(uint64_t iova){
+    for (auto it = m_allocated_memories.begin(); it != m_allocated_memories.end(); ++it) {
+        if (it->external ? (iova < it->pair.iova || iova - it->pair.iova >= it->pair.size) : it->pair.iova != iova) continue;
+        bool ret = _unbindIOVA(it->pair.iova, it->pair.size);
+        if (!it->external && munmap(it->pair.virt, it->pair.size) == -1) {
+            warn("Failed to unmap virtual address %p: %s", it->pair.virt, strerror(errno));
+            ret = false;
+        }
+        // only recycle the IOVA range if the IOMMU really dropped the mapping
+        if (ret) {
+            m_iova_ranges.freeRange(it->pair.iova, it->pair.size);
+        }
+        // memory freed at runtime is not wanted after a restart either, give its huge pages back to the system
+        if (!it->backing_file.empty()) {
+            if (unlink(it->backing_file.c_str()) == -1) {
+                warn("Failed to remove backing file %s: %s", it->backing_file.c_str(), strerror(errno));
+            }
+            m_free_region_indices.insert(it->region_index);
+        }
+        m_allocated_memories.erase(it);
+        return ret;
+    }
+    warn("no DMA mapping found at iova 0x%llx", (unsigned long long) iova);
+    return false;
+}
+
+// carves from the arenas of the container; virt and iova share the offset inside an arena,
+// so aligning the offset aligns both addresses (the region itself is huge-page aligned)
+DMAMemoryPair DMAMemoryAllocator::_carveFromArena(size_t size, size_t alignment, int numa_node){
+    size = _alignUpU64(size, alignment);
+    DMAArena* p_arena = nullptr;
+    uint64_t offset = 0;
+    for (auto& arena : m_arenas) {
+        if (arena.numa_node != numa_node) continue;
+        if (arena.offsets.allocRange(size, alignment, &offset)) {
+            p_arena = &arena;
+            break;
+        }
+    }
+    if (!p_arena) {
+        // the configured size only, _mapRegion takes 1GB pages if the arena is large enough for them
+        DMAArena arena;
+        arena.region = _mapRegion(m_arena_size, numa_node);
+        arena.numa_node = numa_node;
+        arena.offsets = RangeAllocator(0, arena.region.size);
+        arena.num_live = 0;
+        arena.offsets.allocRange(size, alignment, &offset);
+        m_arenas.push_back(arena);
+        p_arena = &m_arenas.back();
+        debug("mapped new DMA arena of 0x%zx bytes at iova 0x%llx", arena.region.size, (unsigned long long) arena.region.iova);
+    }
+    p_arena->num_live++;
+    DMAMemoryPair DMA_mem_pair;
+    DMA_mem_pair.virt = (uint8_t*) p_arena->region.virt + offset;
+    DMA_mem_pair.iova = p_arena->region.iova + offset;
+    DMA_mem_pair.size = size;
+    DMA_mem_pair.page_size = p_arena->region.page_size;
+    DMA_mem_pair.numa_node = p_arena->region.numa_node;
+    return DMA_mem_pair;
+}
+
+void*  DMAMemoryAllocator::_allocDMAVirtualAddr(size_t size, size_t page_size){
+    // no MAP_POPULATE even for warm start: the pages must not be faulted in before _bindToNumaNode
+    int page_flag = (page_size == huge_page_1gb) ? MAP_HUGE_1GB : MAP_HUGE_2MB;
     // using mmap() because it can assign huge page within which the physical memory is continuous.
-    void* virtual_address = (void*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_2MB, -1, 0);
+    void* virtual_address = (void*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB | page_flag, -1, 0);
     if (virtual_address == MAP_FAILED) {
-        error("Failed to mmap DMA memory using huge page. Huge page may have not been enabled. The error code is %s", strerror(errno));
-        exit(EXIT_FAILURE);
+        return nullptr;
     }
     return virtual_address;
 }
 
+uint64_t DMAMemoryAllocator::warmDMAMemory(const DMAMemoryPair& DMA_mem_pair, bool pre_zero){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (mlock(DMA_mem_pair.virt, DMA_mem_pair.size) == -1) {
+        warn("Failed to mlock DMA memory at %p: %s", DMA_mem_pair.virt, strerror(errno));
+    }
+    if (pre_zero) {
+        memset(DMA_mem_pair.virt, 0, DMA_mem_pair.size);
+    } else {
+        // write every 4kB page without changing its content, so page table and TLB work happens now
+        for (size_t offset = 0; offset < DMA_mem_pair.size; offset += 4096) {
+            volatile uint8_t* p = (volatile uint8_t*) DMA_mem_pair.virt + offset;
+            *p = *p;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+}
+
 // this function makes the physical address in DRAM shared both by virtual address space and IOVA. one is for CPU access, the other is for device DMA access.
-bool DMAMemoryAllocator::_bindIOVAWithVirtAddr(void* virt_addr, uint64_t iova, size_t size, int container_fd){
+bool DMAMemoryAllocator::_bindIOVAWithVirtAddr(void* virt_addr, uint64_t iova, size_t size){
 	struct vfio_iommu_type1_dma_map dma_map ={};
 	dma_map.vaddr = (uint64_t) virt_addr;
 	// dma_map.vaddr = (uint64_t) 0x100000;
@@ -57,24 +747,45 @@ bool DMAMemoryAllocator::_bindIOVAWithVirtAddr(void* virt_addr, uint64_t iova, s
 	dma_map.size = size;
 	dma_map.argsz = sizeof(dma_map);
 	dma_map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
-	check_err(ioctl(container_fd, VFIO_IOMMU_MAP_DMA, &dma_map), "IOMMU Map DMA Memory");
+	check_err(ioctl(m_container_fd, VFIO_IOMMU_MAP_DMA, &dma_map), "IOMMU Map DMA Memory");
+	return true;
+}
+
+// the device must not access the range anymore once this returns
+bool DMAMemoryAllocator::_unbindIOVA(uint64_t iova, size_t size){
+	struct vfio_iommu_type1_dma_unmap dma_unmap = {};
+	dma_unmap.argsz = sizeof(dma_unmap);
+	dma_unmap.iova = iova;
+	dma_unmap.size = size;
+	if (ioctl(m_container_fd, VFIO_IOMMU_UNMAP_DMA, &dma_unmap) == -1) {
+		warn("Failed to unmap iova 0x%llx from the IOMMU: %s", (unsigned long long) iova, strerror(errno));
+		return false;
+	}
 	return true;
 }
 
 bool DMAMemoryAllocator::_unmapVirtualAddr(){
     //unmap all allocated virtual addresses
-    for (const auto& DMA_mem_pair : m_allocated_memories) {
-        if (munmap(DMA_mem_pair.virt, DMA_mem_pair.size) == -1) {
-            error("Failed to unmap virtual address %p: %s", DMA_mem_pair.virt, strerror(errno));
-            return false;
+    bool ret = true;
+    for (const auto& mapping : m_allocated_memories) {
+        if (mapping.external) continue;
+        if (munmap(mapping.pair.virt, mapping.pair.size) == -1) {
+            warn("Failed to unmap virtual address %p: %s", mapping.pair.virt, strerror(errno));
+            ret = false;
         }
     }
-    return true;
+    m_allocated_memories.clear();
+    m_arenas.clear();
+    return ret;
 }
 
 bool DMAMemoryAllocator::_unmapIOVirtualAddr(){
-
-    return true;
+    //remove all mappings from the IOMMU, the virtual addresses must stay valid until this is done
+    bool ret = true;
+    for (const auto& mapping : m_allocated_memories) {
+        ret = _unbindIOVA(mapping.pair.iova, mapping.pair.size) && ret;
+    }
+    return ret;
 }
 
 
@@ -2,6 +2,11 @@
 #include <cstdint>
 #include <cstddef>
 #include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <string>
+#include <cstdio>
 
 struct DMAMemoryPair {
     // start of the virtual address
@@ -9,35 +14,195 @@ struct DMAMemoryPair {
     // start of the physical/IO virtual address
     uint64_t iova;
     size_t  size;
+    // huge page size backing this memory (2MB or 1GB)
+    size_t  page_size{0};
+    // NUMA node the memory actually resides on, -1 if unknown
+    int     numa_node{-1};
 };
 
+// first-fit allocator over the address range [start, end), released ranges are merged with their neighbours
+class RangeAllocator {
+    public:
+                                    RangeAllocator              (uint64_t start = 0, uint64_t end = 0)                  ;
+        bool                        allocRange                  (uint64_t size, uint64_t alignment, uint64_t* p_start)  ;
+        void                        freeRange                   (uint64_t start, uint64_t size)                         ;
+        // takes exactly [start, start + size), fails if any part of it is in use
+        bool                        reserveRange                (uint64_t start, uint64_t size)                         ;
+        uint64_t                    getFreeBytes                () const                                                ;
+        uint64_t                    getLargestFreeRange         () const                                                ;
+    private:
+        // start -> size of every free range, ordered by address
+        std::map<uint64_t, uint64_t> m_free_ranges                                                                      ;
+};
+
+// one VFIO_IOMMU_MAP_DMA mapping owned by the allocator
+struct DMAMapping {
+    DMAMemoryPair   pair;
+    // memory owned by the caller, it is only unmapped from the IOMMU but never munmap()ed
+    bool            external{false};
+    // hugetlbfs file behind the mapping, empty for anonymous memory
+    std::string     backing_file{};
+    uint32_t        region_index{0};
+};
+
+// a huge-page region mapped into the IOMMU once, sub-allocations are carved out of it
+struct DMAArena {
+    DMAMemoryPair   region;
+    // NUMA node the arena was requested for, -1 for no preference
+    int             numa_node;
+    // offsets inside the region which are still free
+    RangeAllocator  offsets;
+    // number of sub-allocations not released yet
+    uint32_t        num_live;
+};
+
+// one live allocation as reported by DMAMemoryAllocator::getAllocations
+struct DMAAllocationInfo {
+    DMAMemoryPair   pair;
+    // who asked for the memory, e.g. "rxq3 pool" or "txq0 ring"
+    std::string     owner;
+    // carved out of an arena instead of having its own IOMMU mapping
+    bool            in_arena{false};
+    // caller-owned memory from registerExternalMemory/importDMAMemory
+    bool            external{false};
+};
+
+struct DMAAllocatorStats {
+    uint64_t    num_mappings;   // VFIO_IOMMU_MAP_DMA mappings alive, arenas included
+    uint64_t    mapped_bytes;   // bytes covered by these mappings
+    uint64_t    num_arenas;
+    uint64_t    arena_free_bytes;       // mapped but not handed out, summed over all arenas
+    uint64_t    arena_largest_free;     // largest request an existing arena can still serve
+    uint64_t    live_allocs;    // allocations not released yet
+    uint64_t    live_bytes;
+    uint64_t    total_allocs;
+    uint64_t    total_frees;
+    uint64_t    hugepage_free_2mb;      // free 2MB huge pages left in the system
+    uint64_t    hugepage_free_1gb;      // free 1GB huge pages left in the system
+    uint64_t    reattached_regions;     // file-backed regions found again after a restart
+};
+
+// one allocator per VFIO container: devices sharing a container share its IOVA space and mappings,
+// devices in different containers never see each other's IOVAs
 class DMAMemoryAllocator {
     
     public:
-        static DMAMemoryAllocator& getInstance               ()
-        {
-            static DMAMemoryAllocator instance; 
-            return instance;
-        }
+        /// Allocator of the VFIO container \p container_fd, created on first use.
+        static DMAMemoryAllocator&  getInstance                 (int container_fd)                                      ;
+        /// Unmaps everything the allocator of \p container_fd still holds and destroys it.
+        /// Call it before closing the container, no device of the container may do DMA anymore.
+        static bool                 releaseInstance             (int container_fd)                                      ;
                                     ~DMAMemoryAllocator         ();
     
         /// Allocates huge-page-backed DMA memory and maps it into the VFIO IOMMU.
         /// Use \p virt for CPU access; use \p iova as the device address (e.g. RQ/CC buffers).
-        /// \param size Requested (total) size in bytes (rounded up to huge-page alignment).
-        /// \param container_fd VFIO container fd for VFIO_IOMMU_MAP_DMA.
-        /// \return DMAMemoryPair with .virt, .iova, and .size.
-        DMAMemoryPair               allocDMAMemory              (size_t size, int container_fd);
+        /// In arena mode the memory is carved out of a shared region and only rounded up to \p alignment,
+        /// otherwise it gets its own huge pages and its own IOMMU mapping.
+        /// \param size Requested (total) size in bytes.
+        /// \param alignment Alignment of .virt and .iova inside an arena, must be a power of two.
+        /// \param numa_node NUMA node the huge pages are bound to (the device's node), -1 for no preference.
+        /// \param owner Tag reported by getAllocations()/dump(), e.g. "rxq3 pool".
+        /// \return DMAMemoryPair with .virt, .iova, and .size. .numa_node is the node the pages really landed on.
+        DMAMemoryPair               allocDMAMemory              (size_t size, size_t alignment = 4096, int numa_node = -1,
+                                                                 const std::string& owner = "");
+        /// Releases memory returned by allocDMAMemory. Dedicated mappings are unmapped from the IOMMU and munmap()ed
+        /// right away, arenas once their last sub-allocation is gone. The IOVA range is recycled for later requests.
+        /// A file-backed region also loses its backing file, only memory still mapped at exit is re-attached.
+        /// \return false for memory the allocator does not hold (e.g. freed twice), nothing is released then.
+        bool                        freeDMAMemory               (const DMAMemoryPair& DMA_mem_pair);
+        /// Switches the arena mode on or off. Regions of \p arena_size bytes are mapped on demand per container,
+        /// requests larger than an arena always get a dedicated mapping. Off by default.
+        /// Arenas of 512MB or more are backed by 1GB pages when free ones are left, smaller ones by 2MB pages.
+        void                        setArenaMode                (bool enable, size_t arena_size = 32*1024*1024);
+        bool                        isArenaMode                 () const { return m_arena_mode; }
+        /// Warm start: new regions are mmap()ed with MAP_POPULATE | MAP_LOCKED, so their pages are faulted in and
+        /// locked before the device or the first packet touches them.
+        void                        setWarmStart                (bool enable) { m_warm_start = enable; }
+        bool                        isWarmStart                 () const { return m_warm_start; }
+        /// Faults in and mlock()s every page of \p DMA_mem_pair, zeroing it if \p pre_zero is set.
+        /// \return time spent in nanoseconds.
+        static uint64_t             warmDMAMemory               (const DMAMemoryPair& DMA_mem_pair, bool pre_zero);
+        /// IOVA == VA mode: new mappings use the process virtual address as IOVA, so descriptors can be built from
+        /// plain pointers and pkt_buf::iova is not needed on the data path.
+        void                        setIOVAEqualVA              (bool enable) { m_iova_equal_va = enable; }
+        bool                        isIOVAEqualVA               () const { return m_iova_equal_va; }
+        /// File backing: new regions are named files <dir>/<prefix>_<n>_<iova> on a hugetlbfs mount (e.g. /mnt/huge
+        /// from scripts/setup-hugepages.sh) instead of anonymous huge pages. The files outlive the process, a restarted
+        /// process that requests its regions in the same order re-attaches to the same memory at the same IOVA and
+        /// skips the zeroing of fresh huge pages. \p prefix must be unique per container, e.g. the PCI address.
+        /// The page size is the one of the mount. An empty \p dir switches back to anonymous memory.
+        bool                        setFileBacking              (const std::string& dir, const std::string& prefix);
+        bool                        isFileBacking               () const { return !m_backing_dir.empty(); }
+        /// Deletes the backing files of \p prefix under \p dir, the memory returns to the huge page pool once no
+        /// process maps it anymore.
+        static bool                 removeBackingFiles          (const std::string& dir, const std::string& prefix);
+        /// Maps memory the caller allocated itself (e.g. an application buffer) into the IOMMU, in IOVA == VA mode
+        /// under its own virtual address. Release it with freeDMAMemory, the memory itself stays with the caller.
+        DMAMemoryPair               registerExternalMemory      (void* virt, size_t size, const std::string& owner = "");
+        /// Maps memory of another container's allocator into this container as well, so devices of both containers
+        /// can work on the same buffers. The IOVA of \p DMA_mem_pair is kept if it is still free here.
+        /// Release the import with freeDMAMemory on this allocator before the original is released.
+        DMAMemoryPair               importDMAMemory             (const DMAMemoryPair& DMA_mem_pair, const std::string& owner = "");
+        /// Page sizes the IOMMU of the container supports (VFIO_IOMMU_GET_INFO iova_pgsizes), one bit per size.
+        uint64_t                    getIOMMUPageSizes           ();
+        int                         getContainerFD              () const { return m_container_fd; }
+        DMAAllocatorStats           getStats                    () const;
+        /// Every allocation not released yet, ordered by IOVA.
+        std::vector<DMAAllocationInfo> getAllocations           () const;
+        /// Every VFIO_IOMMU_MAP_DMA mapping of the container, arenas included.
+        std::vector<DMAMemoryPair>  getMappings                 () const;
+        /// Prints mappings, allocations and totals in a human readable table.
+        void                        dump                        (FILE* fp = stdout) const;
+        /// Free huge pages of \p page_size in bytes, on \p numa_node only if it is >= 0.
+        static uint64_t             getHugePageHeadroom         (size_t page_size, int numa_node = -1);
 
     private:                    
-                                    DMAMemoryAllocator          ()                                                      ;
+        explicit                    DMAMemoryAllocator          (int container_fd)                                      ;
         uint64_t                    _alignUpU64                 (uint64_t value, uint64_t alignment)                    ;
-        void*                       _allocDMAVirtualAddr        (size_t ring_size)                                      ;
-        bool                        _bindIOVAWithVirtAddr       (void* virt_addr, uint64_t iova, size_t ring_size, int container_fd)   ;
+        DMAMemoryPair               _mapRegion                  (size_t size, int numa_node)                            ;
+        DMAMemoryPair               _mapFileRegion              (size_t size, int numa_node)                            ;
+        static size_t               _getHugetlbfsPageSize       (const std::string& dir)                                ;
+        bool                        _findBackingFile            (uint32_t region_index, std::string* p_name, uint64_t* p_iova);
+        size_t                      _choosePageSize             (size_t size, int numa_node)                            ;
+        static uint64_t             _getFreeHugePages           (size_t page_size, int numa_node)                       ;
+        bool                        _bindToNumaNode             (void* virt_addr, size_t size, int numa_node)           ;
+        int                         _getNumaNodeOfAddr          (void* virt_addr)                                       ;
+        void                        _populateRegion             (void* virt_addr, size_t size)                          ;
+        bool                        _unmapRegion                (uint64_t iova)                                         ;
+        uint64_t                    _allocIOVA                  (void* virt_addr, size_t size, size_t alignment)        ;
+        DMAMemoryPair               _mapExternal                (void* virt, size_t size, const uint64_t* p_iova_hint)  ;
+        DMAMemoryPair               _carveFromArena             (size_t size, size_t alignment, int numa_node)          ;
+        void*                       _allocDMAVirtualAddr        (size_t ring_size, size_t page_size)                    ;
+        bool                        _bindIOVAWithVirtAddr       (void* virt_addr, uint64_t iova, size_t ring_size)      ;
+        bool                        _unbindIOVA                 (uint64_t iova, size_t size)                            ;
         bool                        _unmapVirtualAddr           ()                                                      ;
         bool                        _unmapIOVirtualAddr         ()                                                      ;
+        static std::map<int, std::unique_ptr<DMAMemoryAllocator>>& _instances                           ();
     private:                                                        
-        uint64_t                    m_page_size                 {2*1024*1024};// 2MB huge page size                                 ;        ;
-        uint64_t                    m_next_iova                 {0x10000}                                        ;
-        std::vector<DMAMemoryPair>  m_allocated_memories                                                                ;
+        int                         m_container_fd              {-1}                                             ;
+        uint64_t                    m_page_size                 {2*1024*1024};// 2MB huge page size, the smallest one we map
+        // iova_pgsizes reported by the container, 0 until queried
+        uint64_t                    m_iommu_page_sizes          {0}                                              ;
+        // IOVA ranges not handed out to any mapping yet
+        RangeAllocator              m_iova_ranges                                                                       ;
+        bool                        m_arena_mode                {false}                                          ;
+        bool                        m_warm_start                {false}                                          ;
+        bool                        m_iova_equal_va             {false}                                          ;
+        size_t                      m_arena_size                {32*1024*1024}                                   ;
+        // hugetlbfs directory of the backing files, empty for anonymous memory
+        std::string                 m_backing_dir                                                                       ;
+        std::string                 m_backing_prefix                                                                    ;
+        size_t                      m_backing_page_size         {0}                                              ;
+        // file-backed regions mapped so far, numbers the backing files in request order
+        uint32_t                    m_num_file_regions          {0}                                              ;
+        // indices of file-backed regions freed at runtime, reused first so the numbering stays dense across restarts
+        std::set<uint32_t>          m_free_region_indices                                                               ;
+        uint64_t                    m_reattached_regions        {0}                                              ;
+        std::vector<DMAMapping>     m_allocated_memories                                                                ;
+        std::vector<DMAArena>       m_arenas                                                                            ;
+        // live allocations by IOVA
+        std::map<uint64_t, DMAAllocationInfo> m_allocations                                                             ;
+        uint64_t                    m_total_allocs              {0}                                              ;
+        uint64_t                    m_total_frees               {0}                                              ;
 
 };
\ No newline at end of file
@@ -4,25 +4,65 @@
 #include <sys/mman.h>
 #include <linux/mman.h>
 #include <unistd.h>
+#include <time.h>
+#include <atomic>
+#include <map>
 #include "log.h"
 #include <sys/ioctl.h>
 #include <linux/vfio.h>
 #include "dma_memory_allocator.h"
 
 
+// pools alive by address, an exiting thread only returns its cache to a pool that is still registered here
+static std::mutex& poolRegistryLock(){
+    static std::mutex lock;
+    return lock;
+}
+
+static std::map<const DMAMemoryPool*, uint64_t>& livePools(){
+    static std::map<const DMAMemoryPool*, uint64_t> pools;
+    return pools;
+}
 
-DMAMemoryPool::DMAMemoryPool(uint32_t num_bufs, uint32_t buf_size, int container_fd):
+DMAMemoryPool::DMAMemoryPool(uint32_t num_bufs, uint32_t buf_size, int container_fd, int numa_node, const std::string& owner,
+                             uint16_t headroom):
     m_num_bufs(num_bufs),
     m_buf_size(buf_size),
-    m_container_fd(container_fd)
+    m_container_fd(container_fd),
+    m_numa_node(numa_node),
+    m_headroom(headroom),
+    m_owner(owner)
 {
+    if ((uint32_t) sizeof(struct pkt_buf) + headroom >= buf_size) {
+        error("headroom %u leaves no room for data in a %u byte pkt_buf", headroom, buf_size);
+    }
     v_free_stack.resize(num_bufs);
     _allocateMemory();
     _createPktBufRing();
+#ifdef VENTURI_POOL_SANITIZER
+    v_owned_bitmap.assign((num_bufs + 63) / 64, 0);
+    v_last_caller.resize(num_bufs);
+    for (uint32_t idx = 0; m_DMA_mem_pair.virt && idx < num_bufs; idx++) {
+        _poisonPktBuf(v_free_stack[idx]);
+    }
+    info("pool sanitizer enabled for pool '%s'", m_owner.c_str());
+#endif
+    static std::atomic<uint64_t> next_pool_id{1};
+    m_pool_id = next_pool_id.fetch_add(1, std::memory_order_relaxed);
+    {
+        std::lock_guard<std::mutex> guard(poolRegistryLock());
+        livePools()[this] = m_pool_id;
+    }
     info("MemoryPool created");
 }
 
 DMAMemoryPool::~DMAMemoryPool(){
+    {
+        std::lock_guard<std::mutex> guard(poolRegistryLock());
+        livePools().erase(this);
+    }
+    // the pkt_bufs must not be linked to any descriptor anymore, the device loses access to them here
+    DMAMemoryAllocator::getInstance(m_container_fd).freeDMAMemory(m_DMA_mem_pair);
 }
 
 bool DMAMemoryPool::_allocateMemory(){
@@ -30,8 +70,8 @@ bool DMAMemoryPool::_allocateMemory(){
         error("No valid container fd provided, DMA memory may not be IOMMU mapped");
         return false;
     }
-    DMAMemoryAllocator& dma_allocator = DMAMemoryAllocator::getInstance();
-    m_DMA_mem_pair = dma_allocator.allocDMAMemory(m_num_bufs * m_buf_size, m_container_fd);
+    DMAMemoryAllocator& dma_allocator = DMAMemoryAllocator::getInstance(m_container_fd);
+    m_DMA_mem_pair = dma_allocator.allocDMAMemory(m_num_bufs * m_buf_size, 4096, m_numa_node, m_owner);
     return true;
 }
 
@@ -41,47 +81,80 @@ bool DMAMemoryPool::_createPktBufRing(){
         return false;
     }
     for (uint32_t idx = 0; idx < m_num_bufs; idx++) {
-        v_free_stack[idx] = idx;
         // the start virtual address of this pkt_buf
         struct pkt_buf* buf = (struct pkt_buf*) (((uint8_t*) m_DMA_mem_pair.virt) + idx * m_buf_size);
+        v_free_stack[idx] = buf;
         // the offset is shared by virtual and physical address
         uintptr_t offset = (uintptr_t) (idx * m_buf_size);
         // iova has already bound to the virtual address in DMA memory allocator
         buf->iova = (uintptr_t) m_DMA_mem_pair.iova + offset;
         buf->idx = idx;
         buf->size = 0;
-        buf->data = (uint8_t*) buf + sizeof(struct pkt_buf);
+        buf->pool = this;
+        buf->refcnt = 1;
+        buf->data_off = getDataOffset();
+        buf->timestamp = 0;
+        buf->ol_flags = 0;
+        buf->packet_type = 0;
+        buf->vlan_tci = 0;
+        buf->rss_hash = 0;
+        buf->port = 0;
+        buf->queue = 0;
+        buf->next = nullptr;
+        buf->pkt_len = 0;
+        buf->nb_segs = 1;
     }
     m_free_stack_top = m_num_bufs;
     return true;
 }
 
-uint32_t DMAMemoryPool::popOutMultiPktBuf(struct pkt_buf** v_p_bufs, uint32_t num_bufs){
-    uint32_t actual_num = 0;
-    if (num_bufs > m_free_stack_top) {
-        num_bufs = m_free_stack_top;
-    }
+uint32_t DMAMemoryPool::popOutMultiPktBuf(struct pkt_buf** v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_PARAM){
+    num_bufs = m_thread_safe ? _popCached(v_p_bufs, num_bufs) : _popShared(v_p_bufs, num_bufs);
+#ifdef VENTURI_POOL_SANITIZER
+    _sanitizeAlloc(v_p_bufs, num_bufs, caller);
+#endif
+    // the caller writes the header (descriptor address, size) next
     for (uint32_t i = 0; i < num_bufs; i++) {
-        struct pkt_buf* buf = popOutOnePktBufFromTop();
-        if (!buf) {
-            warn("Failed to take out pkt_buf");
-            break;
-        }
-        v_p_bufs[i] = buf;
-        actual_num++;
+        __builtin_prefetch(v_p_bufs[i], 1);
     }
-    return actual_num;
+    return num_bufs;
 }
 // this function will reduce m_free_stack_top by 1
-struct pkt_buf* DMAMemoryPool::popOutOnePktBufFromTop(){
-    if (m_free_stack_top == 0) {
+struct pkt_buf* DMAMemoryPool::popOutOnePktBufFromTop(POOL_SANITIZER_CALLER_PARAM_ONLY){
+    struct pkt_buf* buf = nullptr;
+    if (m_thread_safe) {
+        _popCached(&buf, 1);
+    } else if (m_free_stack_top == 0) {
         // warn("no free pkt_buf available");
         return nullptr;
+    } else {
+        buf = v_free_stack[--m_free_stack_top];
     }
-    uint32_t idx = v_free_stack[--m_free_stack_top];
-    struct pkt_buf* buf = (struct pkt_buf*) (((uint8_t*) m_DMA_mem_pair.virt) + idx * m_buf_size);
+#ifdef VENTURI_POOL_SANITIZER
+    _sanitizeAlloc(&buf, buf ? 1 : 0, caller);
+#endif
     return buf;
 }
+uint64_t DMAMemoryPool::warmUp(bool pre_zero){
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    DMAMemoryAllocator::warmDMAMemory(m_DMA_mem_pair, false);
+    if (pre_zero) {
+        for (uint32_t idx = 0; idx < m_num_bufs; idx++) {
+            struct pkt_buf* buf = (struct pkt_buf*) (((uint8_t*) m_DMA_mem_pair.virt) + idx * m_buf_size);
+#ifdef VENTURI_POOL_SANITIZER
+            // free pkt_bufs keep their poison
+            if (!(v_owned_bitmap[idx >> 6] & (1ull << (idx & 63)))) {
+                continue;
+            }
+#endif
+            memset(buf->getData(), 0, getDataRoom());
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (uint64_t) (end.tv_sec - start.tv_sec) * 1000000000ull + (uint64_t) end.tv_nsec - (uint64_t) start.tv_nsec;
+}
+
 // this function does not reduce m_free_stack_top
 struct pkt_buf* DMAMemoryPool::getBuf(uint16_t idx){
     if (idx >= m_num_bufs) {
@@ -92,12 +165,340 @@ struct pkt_buf* DMAMemoryPool::getBuf(uint16_t idx){
     return buf;
 }
 
-void DMAMemoryPool::freePktBuf(struct pkt_buf* buf){
+void DMAMemoryPool::freePktBuf(struct pkt_buf* buf POOL_SANITIZER_CALLER_PARAM){
+    if (!buf) return;
+#ifdef VENTURI_POOL_SANITIZER
+    _sanitizeFree(&buf, 1, caller);
+#endif
+    if (m_thread_safe) {
+        _pushCached(&buf, 1);
+        return;
+    }
     if (m_free_stack_top >= m_num_bufs) {
         warn("freePktBuf: free stack overflow, possible double-free of buf idx %u", buf->idx);
         return;
     }
-    v_free_stack[m_free_stack_top++] = buf->idx;
+    v_free_stack[m_free_stack_top++] = buf;
+}
+
+void DMAMemoryPool::freeMultiPktBuf(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_PARAM){
+#ifdef VENTURI_POOL_SANITIZER
+    _sanitizeFree(v_p_bufs, num_bufs, caller);
+#endif
+    if (m_thread_safe) {
+        _pushCached(v_p_bufs, num_bufs);
+        return;
+    }
+    _pushShared(v_p_bufs, num_bufs);
+}
+
+struct pkt_buf* DMAMemoryPool::clonePktBuf(struct pkt_buf* buf){
+    __atomic_add_fetch(&buf->refcnt, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+// true if the caller held the last reference. a single owner skips the atomic operation, nobody else can
+// add a reference then. the count is reset to 1 for the next user of the pkt_buf
+static inline bool dropPktBufRef(struct pkt_buf* buf){
+    if (__atomic_load_n(&buf->refcnt, __ATOMIC_ACQUIRE) == 1) {
+        return true;
+    }
+    if (__atomic_sub_fetch(&buf->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+        buf->refcnt = 1;
+        return true;
+    }
+    return false;
+}
+
+// returns every segment of a chain whose last reference is gone, the segments leave unchained
+static inline void freePktBufChain(struct pkt_buf* buf POOL_SANITIZER_CALLER_PARAM){
+    while (buf) {
+        struct pkt_buf* next = buf->next;
+        buf->next = nullptr;
+        buf->nb_segs = 1;
+        buf->pool->freePktBuf(buf POOL_SANITIZER_CALLER);
+        buf = next;
+    }
+}
+
+void DMAMemoryPool::releasePktBuf(struct pkt_buf* buf POOL_SANITIZER_CALLER_PARAM){
+    if (!dropPktBufRef(buf)) return;
+    if (buf->next) {
+        freePktBufChain(buf POOL_SANITIZER_CALLER);
+        return;
+    }
+    buf->pool->freePktBuf(buf POOL_SANITIZER_CALLER);
+}
+
+void DMAMemoryPool::releaseMultiPktBuf(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_PARAM){
+    if (!num_bufs) return;
+    // common case: unchained single owners of one pool, the batch goes back as it is
+    DMAMemoryPool* pool = v_p_bufs[0] ? v_p_bufs[0]->pool : nullptr;
+    uint32_t i = 0;
+    while (pool && i < num_bufs && v_p_bufs[i] && v_p_bufs[i]->refcnt == 1 && !v_p_bufs[i]->next &&
+           v_p_bufs[i]->pool == pool) {
+        i++;
+    }
+    if (i == num_bufs) {
+        pool->freeMultiPktBuf(v_p_bufs, num_bufs POOL_SANITIZER_CALLER);
+        return;
+    }
+    // otherwise collect the pkt_bufs whose last reference is gone, one run per pool
+    struct pkt_buf* to_free[64];
+    uint32_t num_to_free = 0;
+    for (i = 0; i < num_bufs; i++) {
+        struct pkt_buf* buf = v_p_bufs[i];
+        if (!buf || !dropPktBufRef(buf)) continue;
+        if (buf->next) {
+            freePktBufChain(buf POOL_SANITIZER_CALLER);
+            continue;
+        }
+        if (num_to_free == 64 || (num_to_free && buf->pool != pool)) {
+            pool->freeMultiPktBuf(to_free, num_to_free POOL_SANITIZER_CALLER);
+            num_to_free = 0;
+        }
+        pool = buf->pool;
+        to_free[num_to_free++] = buf;
+    }
+    if (num_to_free) {
+        pool->freeMultiPktBuf(to_free, num_to_free POOL_SANITIZER_CALLER);
+    }
+}
+
+void DMAMemoryPool::setThreadSafe(bool enable, uint32_t cache_size){
+    _drainCaches();
+    v_caches.clear();
+    if (!enable) {
+        m_thread_safe = false;
+        return;
+    }
+    m_cache_size = cache_size;
+    v_caches.resize(MAX_POOL_THREADS);
+    m_thread_safe = true;
+}
+
+// no other thread uses the pool anymore, so every cache can be emptied from here
+void DMAMemoryPool::_drainCaches(){
+    for (auto& cache : v_caches) {
+        if (!cache) continue;
+        _pushShared(cache->objs.data(), cache->len);
+        cache->len = 0;
+    }
+}
+
+// called by the thread of the slot on its exit, the cache is not touched by anyone else
+void DMAMemoryPool::_releaseThreadCache(uint32_t slot){
+    if (slot >= v_caches.size() || !v_caches[slot]) {
+        return;
+    }
+    PktBufCache* cache = v_caches[slot].get();
+    std::lock_guard<std::mutex> guard(m_shared_lock);
+    _pushShared(cache->objs.data(), cache->len);
+    cache->len = 0;
+}
+
+// takes from the free stack, the caller holds m_shared_lock in thread-safe mode
+uint32_t DMAMemoryPool::_popShared(struct pkt_buf** v_p_bufs, uint32_t num_bufs){
+    if (num_bufs > m_free_stack_top) {
+        num_bufs = m_free_stack_top;
+    }
+    m_free_stack_top -= num_bufs;
+    memcpy(v_p_bufs, v_free_stack.data() + m_free_stack_top, num_bufs * sizeof(struct pkt_buf*));
+    return num_bufs;
+}
+
+// returns to the free stack, the caller holds m_shared_lock in thread-safe mode
+bool DMAMemoryPool::_pushShared(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs){
+    if (num_bufs > m_num_bufs - m_free_stack_top) {
+        warn("freeMultiPktBuf: free stack overflow, possible double-free of %u bufs", num_bufs);
+        return false;
+    }
+    memcpy(v_free_stack.data() + m_free_stack_top, v_p_bufs, num_bufs * sizeof(struct pkt_buf*));
+    m_free_stack_top += num_bufs;
+    return true;
+}
+
+// slots of exited threads, handed to the next new thread first
+static std::vector<uint32_t>& freeThreadSlots(){
+    static std::vector<uint32_t> slots;
+    return slots;
+}
+
+// every thread gets a slot on its first pool operation, shared by all pools. when the thread exits its caches
+// go back to the pools that are still alive and the slot is reused
+struct PoolThreadSlot {
+    uint32_t slot;
+    // pools the thread has a cache in, with their id
+    std::vector<std::pair<DMAMemoryPool*, uint64_t>> pools;
+
+    PoolThreadSlot(){
+        static uint32_t next_slot = 0;
+        std::lock_guard<std::mutex> guard(poolRegistryLock());
+        // touching the registry here makes it outlive this object
+        livePools();
+        if (!freeThreadSlots().empty()) {
+            slot = freeThreadSlots().back();
+            freeThreadSlots().pop_back();
+        } else {
+            slot = next_slot++;
+        }
+    }
+    ~PoolThreadSlot(){
+        std::lock_guard<std::mutex> guard(poolRegistryLock());
+        for (auto& [pool, pool_id] : pools) {
+            auto it = livePools().find(pool);
+            if (it != livePools().end() && it->second == pool_id) {
+                pool->_releaseThreadCache(slot);
+            }
+        }
+        freeThreadSlots().push_back(slot);
+    }
+};
+
+static PoolThreadSlot& getThreadSlot(){
+    thread_local PoolThreadSlot thread_slot;
+    return thread_slot;
 }
 
+PktBufCache* DMAMemoryPool::_getThreadCache(){
+    PoolThreadSlot& thread_slot = getThreadSlot();
+    if (thread_slot.slot >= v_caches.size()) {
+        return nullptr;
+    }
+    std::unique_ptr<PktBufCache>& cache = v_caches[thread_slot.slot];
+    if (!cache) {
+        cache.reset(new PktBufCache);
+        cache->objs.resize(2 * m_cache_size);
+        thread_slot.pools.push_back({this, m_pool_id});
+    }
+    return cache.get();
+}
 
+// the cache holds at most m_cache_size pkt_bufs between two calls
+uint32_t DMAMemoryPool::_popCached(struct pkt_buf** v_p_bufs, uint32_t num_bufs){
+    PktBufCache* cache = _getThreadCache();
+    if (!cache || num_bufs > m_cache_size) {
+        std::lock_guard<std::mutex> guard(m_shared_lock);
+        return _popShared(v_p_bufs, num_bufs);
+    }
+    if (cache->len < num_bufs) {
+        // refill up to a full cache on top of this request, so the next requests do not need the lock
+        std::lock_guard<std::mutex> guard(m_shared_lock);
+        cache->len += _popShared(cache->objs.data() + cache->len, m_cache_size + num_bufs - cache->len);
+        if (cache->len < num_bufs) {
+            num_bufs = cache->len;
+        }
+    }
+    cache->len -= num_bufs;
+    memcpy(v_p_bufs, cache->objs.data() + cache->len, num_bufs * sizeof(struct pkt_buf*));
+    return num_bufs;
+}
+
+void DMAMemoryPool::_pushCached(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs){
+    PktBufCache* cache = _getThreadCache();
+    if (!cache || num_bufs > m_cache_size) {
+        std::lock_guard<std::mutex> guard(m_shared_lock);
+        _pushShared(v_p_bufs, num_bufs);
+        return;
+    }
+    memcpy(cache->objs.data() + cache->len, v_p_bufs, num_bufs * sizeof(struct pkt_buf*));
+    cache->len += num_bufs;
+    if (cache->len > m_cache_size) {
+        // drain the excess to the shared stack in one go
+        std::lock_guard<std::mutex> guard(m_shared_lock);
+        _pushShared(cache->objs.data() + m_cache_size, cache->len - m_cache_size);
+        cache->len = m_cache_size;
+    }
+}
+
+#ifdef VENTURI_POOL_SANITIZER
+// index of \p buf in this pool, aborts if it is not the start of one of its pkt_bufs or its header is broken
+uint32_t DMAMemoryPool::_sanitizerIndex(const struct pkt_buf* buf, const std::source_location& caller){
+    uintptr_t start = (uintptr_t) m_DMA_mem_pair.virt;
+    uintptr_t offset = (uintptr_t) buf - start;
+    if ((uintptr_t) buf < start || offset >= (uintptr_t) m_num_bufs * m_buf_size || offset % m_buf_size) {
+        error("pool sanitizer: %p is no pkt_buf of pool '%s', called from %s:%u %s()", (const void*) buf,
+              m_owner.c_str(), caller.file_name(), caller.line(), caller.function_name());
+    }
+    uint32_t idx = (uint32_t) (offset / m_buf_size);
+    if (buf->idx != idx || buf->pool != this) {
+        error("pool sanitizer: header of pkt_buf %u of pool '%s' overwritten (idx %u, pool %p), called from %s:%u %s()",
+              idx, m_owner.c_str(), buf->idx, (void*) buf->pool, caller.file_name(), caller.line(), caller.function_name());
+    }
+    return idx;
+}
+
+// everything behind the header gets the poison, the first 8 bytes of the headroom the canary
+void DMAMemoryPool::_poisonPktBuf(struct pkt_buf* buf){
+    uint8_t* start = (uint8_t*) buf + sizeof(struct pkt_buf);
+    memset(start, POOL_SANITIZER_POISON, m_buf_size - sizeof(struct pkt_buf));
+    if (m_headroom >= sizeof(uint64_t)) {
+        uint64_t canary = POOL_SANITIZER_CANARY;
+        memcpy(start, &canary, sizeof(canary));
+    }
+}
+
+void DMAMemoryPool::_sanitizeAlloc(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs, const std::source_location& caller){
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        struct pkt_buf* buf = v_p_bufs[i];
+        uint32_t idx = _sanitizerIndex(buf, caller);
+        const std::source_location& last = v_last_caller[idx];
+        uint64_t bit = 1ull << (idx & 63);
+        if (__atomic_fetch_or(&v_owned_bitmap[idx >> 6], bit, __ATOMIC_RELAXED) & bit) {
+            error("pool sanitizer: pkt_buf %u of pool '%s' handed out twice, the free stack is corrupt. called from %s:%u %s(), "
+                  "last handed out at %s:%u", idx, m_owner.c_str(), caller.file_name(), caller.line(), caller.function_name(),
+                  last.file_name(), last.line());
+        }
+        // nothing may have touched the pkt_buf since it was returned
+        const uint8_t* start = (const uint8_t*) buf + sizeof(struct pkt_buf);
+        uint32_t len = m_buf_size - sizeof(struct pkt_buf);
+        uint32_t off = 0;
+        if (m_headroom >= sizeof(uint64_t)) {
+            uint64_t canary;
+            memcpy(&canary, start, sizeof(canary));
+            if (canary != POOL_SANITIZER_CANARY) {
+                error("pool sanitizer: headroom canary of free pkt_buf %u of pool '%s' overwritten, returned at %s:%u %s()",
+                      idx, m_owner.c_str(), last.file_name(), last.line(), last.function_name());
+            }
+            off = sizeof(uint64_t);
+        }
+        for (; off < len; off++) {
+            if (start[off] != POOL_SANITIZER_POISON) {
+                error("pool sanitizer: pkt_buf %u of pool '%s' written after it was returned (byte %u behind the header), "
+                      "returned at %s:%u %s()", idx, m_owner.c_str(), off, last.file_name(), last.line(), last.function_name());
+            }
+        }
+        v_last_caller[idx] = caller;
+    }
+}
+
+void DMAMemoryPool::_sanitizeFree(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs, const std::source_location& caller){
+    for (uint32_t i = 0; i < num_bufs; i++) {
+        struct pkt_buf* buf = v_p_bufs[i];
+        uint32_t idx = _sanitizerIndex(buf, caller);
+        uint64_t bit = 1ull << (idx & 63);
+        if (!(__atomic_fetch_and(&v_owned_bitmap[idx >> 6], ~bit, __ATOMIC_RELAXED) & bit)) {
+            const std::source_location& last = v_last_caller[idx];
+            error("pool sanitizer: double free of pkt_buf %u of pool '%s', called from %s:%u %s(), already returned at %s:%u %s()",
+                  idx, m_owner.c_str(), caller.file_name(), caller.line(), caller.function_name(),
+                  last.file_name(), last.line(), last.function_name());
+        }
+        if (buf->refcnt != 1 || buf->next) {
+            error("pool sanitizer: pkt_buf %u of pool '%s' returned with %u references or a chain left, called from %s:%u %s()",
+                  idx, m_owner.c_str(), buf->refcnt, caller.file_name(), caller.line(), caller.function_name());
+        }
+        // the canary is only checked while the payload does not start on top of it
+        if (m_headroom >= sizeof(uint64_t) && buf->data_off >= sizeof(struct pkt_buf) + sizeof(uint64_t)) {
+            uint64_t canary;
+            memcpy(&canary, (uint8_t*) buf + sizeof(struct pkt_buf), sizeof(canary));
+            if (canary != POOL_SANITIZER_CANARY) {
+                error("pool sanitizer: headroom canary of pkt_buf %u of pool '%s' overwritten, something wrote in front of "
+                      "the payload. called from %s:%u %s()", idx, m_owner.c_str(), caller.file_name(), caller.line(),
+                      caller.function_name());
+            }
+        }
+        _poisonPktBuf(buf);
+        v_last_caller[idx] = caller;
+    }
+}
+#endif
@@ -1,20 +1,112 @@
 #pragma once
 #include <cstdint>
 #include <vector>
+#include <string>
+#include <mutex>
+#include <memory>
 #include "dma_memory_allocator.h"
-#define SIZE_PKT_BUF_HEADROOM 40
+#define PKT_BUF_HEADROOM 64 // default room between header and payload, e.g. to prepend an encapsulation header
+#define PKT_BUF_CACHE_SIZE 256 // default number of pkt_bufs a thread keeps for itself in a thread-safe pool
+#define MAX_POOL_THREADS 64 // threads that get a cache, any further thread always takes the shared lock
 
-struct pkt_buf {
-	// physical address to pass a buffer to a nic
+// pool sanitizer (cmake -DVENTURI_POOL_SANITIZER=ON): every pkt_buf handed out and returned is checked against an
+// ownership bitmap, the payload of free pkt_bufs is poisoned and the start of the headroom holds a canary.
+// a violation aborts with the call site of the pool operation. without it the checks and the extra caller
+// argument compile to nothing
+#ifdef VENTURI_POOL_SANITIZER
+#include <source_location>
+#define POOL_SANITIZER_CALLER_DECL  , const std::source_location& caller = std::source_location::current()
+#define POOL_SANITIZER_CALLER_PARAM , const std::source_location& caller
+#define POOL_SANITIZER_CALLER       , caller
+#define POOL_SANITIZER_CALLER_DECL_ONLY  const std::source_location& caller = std::source_location::current()
+#define POOL_SANITIZER_CALLER_PARAM_ONLY const std::source_location& caller
+#define POOL_SANITIZER_POISON       0x6b                    // byte pattern of free payloads
+#define POOL_SANITIZER_CANARY       0x5afe5afe5afe5afeull   // first 8 bytes of the headroom
+#else
+#define POOL_SANITIZER_CALLER_DECL
+#define POOL_SANITIZER_CALLER_PARAM
+#define POOL_SANITIZER_CALLER
+#define POOL_SANITIZER_CALLER_DECL_ONLY
+#define POOL_SANITIZER_CALLER_PARAM_ONLY
+#endif
+
+// pkt_buf::ol_flags, offload results of a received packet
+#define PKT_RX_RSS_HASH         (1u << 0)   // rss_hash holds the RSS hash
+#define PKT_RX_FDIR             (1u << 1)   // matched a flow director filter, rss_hash holds the filter id
+#define PKT_RX_VLAN             (1u << 2)   // the frame carried a VLAN tag
+#define PKT_RX_VLAN_STRIPPED    (1u << 3)   // the tag was removed from the frame, vlan_tci holds it
+#define PKT_RX_IP_CKSUM_GOOD    (1u << 4)
+#define PKT_RX_IP_CKSUM_BAD     (1u << 5)
+#define PKT_RX_L4_CKSUM_GOOD    (1u << 6)
+#define PKT_RX_L4_CKSUM_BAD     (1u << 7)
+#define PKT_RX_TIMESTAMP        (1u << 8)   // timestamp holds the nic clock in ns since the epoch
+#define PKT_RX_IEEE1588_TMST    (1u << 9)   // ... latched by the nic for this very packet, not per batch
+#define PKT_RX_HDR_SPLIT        (1u << 10)  // the first segment holds the headers only, the payload starts in next
+#define PKT_RX_TIMESTAMP_BATCH  (1u << 11)  // timestamp is the nic clock read once per batch, good to the poll interval
+// set by the application: the nic latches the send time of the packet (see Intel82599Dev::readTxTimestamp)
+#define PKT_TX_IEEE1588_TMST    (1u << 16)
+
+// pkt_buf::packet_type, headers the nic found. the bits match the packet type field of the 82599
+// write-back descriptor shifted right by 4
+#define PKT_TYPE_IPV4           0x0001
+#define PKT_TYPE_IPV4_EXT       0x0002      // IPv4 with options
+#define PKT_TYPE_IPV6           0x0004
+#define PKT_TYPE_IPV6_EXT       0x0008      // IPv6 with extension headers
+#define PKT_TYPE_TCP            0x0010
+#define PKT_TYPE_UDP            0x0020
+#define PKT_TYPE_SCTP           0x0040
+
+class DMAMemoryPool;
+struct PoolThreadSlot;
+
+// the header is exactly one cache line holding everything the rx/tx path touches per packet,
+// the payload follows after the headroom of the pool and is located by data_off
+struct alignas(64) pkt_buf {
+	// physical address of the pkt_buf to pass a buffer to a nic, not read on the data path in IOVA == VA mode
 	uintptr_t iova;
+	// pool the pkt_buf returns to, also when it is released through another queue's ring
+	DMAMemoryPool* pool;
+	// receive time stamp, 0 if none was taken
+	uint64_t timestamp;
+	// offload flags of the packet, PKT_RX_*
+	uint32_t ol_flags;
+	// PKT_TYPE_* of the packet, 0 if unknown
+	uint16_t packet_type;
+	// VLAN tag removed by the nic, valid with PKT_RX_VLAN_STRIPPED
+	uint16_t vlan_tci;
     // index of this pkt_buf in the mempool
 	uint32_t idx;
+	// length of the whole packet over all segments, only valid in the first segment
+	uint32_t pkt_len;
+	// offset of the payload from the start of the pkt_buf, header plus headroom of the pool
+	uint16_t data_off;
+	// references held by consumers, 1 while the pkt_buf is free or has a single owner
+	uint16_t refcnt;
+	// port and queue the packet was received on
+	uint16_t port;
+	uint16_t queue;
+	// next segment of a chained packet, nullptr in the last one
+	struct pkt_buf* next;
+	// RSS hash with PKT_RX_RSS_HASH, flow filter id with PKT_RX_FDIR
+	uint32_t rss_hash;
     // actual size in byte of the data in the buffer, initialized to 0
-	uint32_t size;
-	uint8_t head_room[SIZE_PKT_BUF_HEADROOM];
-	uint8_t* data __attribute__((aligned(64)));
+	uint16_t size;
+	// number of segments of the packet, only valid in the first segment, 1 if not chained
+	uint16_t nb_segs;
+
+	uint8_t*        getData()             { return (uint8_t*) this + data_off; }
+	const uint8_t*  getData()       const { return (const uint8_t*) this + data_off; }
+	// device address of the payload
+	uintptr_t       getDataIOVA()   const { return iova + data_off; }
 };
+static_assert(sizeof(struct pkt_buf) == 64, "the pkt_buf header has to fit into one cache line");
 
+// free pkt_bufs a thread keeps for itself, only ever touched by that thread
+struct alignas(64) PktBufCache {
+	uint32_t len{0};
+	// 2 * cache size slots, a batch can be added before the excess is drained
+	std::vector<struct pkt_buf*> objs;
+};
 
 class DMAMemoryPool{
 
@@ -24,23 +116,90 @@ class DMAMemoryPool{
         /// \param num_buf Number of pkt_buf structures to allocate.
         /// \param buf_size Size of each pkt_buf structure including data buffer.
         /// \param container_fd VFIO container fd for VFIO_IOMMU_MAP_DMA.
-        DMAMemoryPool(uint32_t num_buf, uint32_t buf_size, int container_fd = -1);
+        /// \param numa_node NUMA node of the device using the pool, -1 for no preference.
+        /// \param owner Tag of the pool in the allocator's introspection, e.g. "rxq3 pool".
+        /// \param headroom Bytes between the header and the payload of every pkt_buf.
+        DMAMemoryPool(uint32_t num_buf, uint32_t buf_size, int container_fd = -1, int numa_node = -1,
+                      const std::string& owner = "", uint16_t headroom = PKT_BUF_HEADROOM);
         ~DMAMemoryPool();
-        struct pkt_buf*             popOutOnePktBufFromTop();
-        uint32_t                    popOutMultiPktBuf(struct pkt_buf** v_p_bufs, uint32_t num_bufs);
-        void                        freePktBuf(struct pkt_buf* buf);
+        struct pkt_buf*             popOutOnePktBufFromTop(POOL_SANITIZER_CALLER_DECL_ONLY);
+        /// Takes up to \p num_bufs pkt_bufs off the free stack with one copy and prefetches their headers.
+        /// \return number of pkt_bufs written to \p v_p_bufs, less than \p num_bufs if the pool runs dry.
+        uint32_t                    popOutMultiPktBuf(struct pkt_buf** v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_DECL);
+        /// Returns \p buf to the free stack, nullptr is ignored.
+        void                        freePktBuf(struct pkt_buf* buf POOL_SANITIZER_CALLER_DECL);
+        /// Returns \p num_bufs pkt_bufs (none of them nullptr) to the free stack with one copy.
+        void                        freeMultiPktBuf(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_DECL);
+        /// Zero-copy clone: adds a reference to \p buf and returns it, e.g. to capture a frame and mirror it to
+        /// another tx queue at the same time. Every reference is dropped with releasePktBuf.
+        static struct pkt_buf*      clonePktBuf(struct pkt_buf* buf);
+        /// Drops one reference, the last one returns \p buf to its own pool. A pool shared by several threads
+        /// has to be thread-safe (setThreadSafe). The reference of the first segment of a chained packet covers
+        /// the whole chain, every segment is returned with it. freePktBuf/freeMultiPktBuf never follow next.
+        static void                 releasePktBuf(struct pkt_buf* buf POOL_SANITIZER_CALLER_DECL);
+        /// releasePktBuf for a batch, the pkt_bufs may belong to different pools, nullptr entries are skipped.
+        static void                 releaseMultiPktBuf(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs POOL_SANITIZER_CALLER_DECL);
         struct pkt_buf*             getBuf(uint16_t idx);
         uint32_t                    getNumOfBufs() const     { return m_num_bufs; }
         uint32_t                    getBufSize()   const     { return m_buf_size; }
+        uint16_t                    getHeadroom()  const     { return m_headroom; }
+        // offset of the payload in a fresh pkt_buf and the payload bytes behind it
+        uint16_t                    getDataOffset() const    { return sizeof(struct pkt_buf) + m_headroom; }
+        uint32_t                    getDataRoom()  const     { return m_buf_size - getDataOffset(); }
+        /// Faults in, locks and optionally zeroes the payload of every pkt_buf, the headers are kept.
+        /// Call it before the queues are enabled. \return time spent in nanoseconds.
+        uint64_t                    warmUp(bool pre_zero);
+        int                         getNumaNode()  const     { return m_DMA_mem_pair.numa_node; }
+        // true if the pool was mapped in IOVA == VA mode, pkt_buf::iova then equals the pkt_buf address
+        bool                        isIOVAEqualVA() const    { return m_DMA_mem_pair.iova == (uint64_t) m_DMA_mem_pair.virt; }
+        /// Thread-safe mode: every thread allocates from and frees to its own lock-free cache of \p cache_size
+        /// pkt_bufs, which is refilled from and drained to the shared free stack in bulk under a lock.
+        /// pkt_bufs may then be freed by another thread than the one that allocated them.
+        /// Switch it while no other thread uses the pool, switching it off (or on again) returns all cached pkt_bufs.
+        /// The cache of a thread goes back to the pool when the thread exits.
+        void                        setThreadSafe(bool enable, uint32_t cache_size = PKT_BUF_CACHE_SIZE);
+        bool                        isThreadSafe() const     { return m_thread_safe; }
                                                        
     private:
+        friend struct PoolThreadSlot;
         bool                        _allocateMemory();
         bool                        _createPktBufRing();
+        uint32_t                    _popShared(struct pkt_buf** v_p_bufs, uint32_t num_bufs);
+        bool                        _pushShared(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs);
+        uint32_t                    _popCached(struct pkt_buf** v_p_bufs, uint32_t num_bufs);
+        void                        _pushCached(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs);
+        PktBufCache*                _getThreadCache();
+        void                        _drainCaches();
+        void                        _releaseThreadCache(uint32_t slot);
+#ifdef VENTURI_POOL_SANITIZER
+        uint32_t                    _sanitizerIndex(const struct pkt_buf* buf, const std::source_location& caller);
+        void                        _sanitizeAlloc(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs, const std::source_location& caller);
+        void                        _sanitizeFree(struct pkt_buf* const* v_p_bufs, uint32_t num_bufs, const std::source_location& caller);
+        void                        _poisonPktBuf(struct pkt_buf* buf);
+#endif
         uint32_t                    m_num_bufs{0};
         uint32_t                    m_buf_size{0};
         uint32_t                    m_free_stack_top{0};
         int                         m_container_fd{-1} ;   
-        std::vector<uint32_t>       v_free_stack;
-        DMAMemoryPair               m_DMA_mem_pair; 
+        int                         m_numa_node{-1}    ;
+        uint16_t                    m_headroom{PKT_BUF_HEADROOM};
+        std::string                 m_owner            ;
+        // free pkt_bufs, the top of the stack is handed out first
+        std::vector<struct pkt_buf*> v_free_stack;
+        DMAMemoryPair               m_DMA_mem_pair{nullptr,0,0}; 
+        bool                        m_thread_safe{false};
+        uint32_t                    m_cache_size{PKT_BUF_CACHE_SIZE};
+        // guards v_free_stack and m_free_stack_top in thread-safe mode
+        std::mutex                  m_shared_lock;
+        // indexed by the thread slot, created by the owning thread on first use
+        std::vector<std::unique_ptr<PktBufCache>> v_caches;
+        // tells this pool apart from a later one at the same address when an exiting thread returns its cache
+        uint64_t                    m_pool_id{0};
+#ifdef VENTURI_POOL_SANITIZER
+        // one bit per pkt_buf, set while it is handed out
+        std::vector<uint64_t>       v_owned_bitmap;
+        // where every pkt_buf was handed out or returned last
+        std::vector<std::source_location> v_last_caller;
+#endif
 
 };
\ No newline at end of file
@@ -29,6 +29,11 @@ bool FPGADev::initHardware() {
     return false;
   }
 
+  // The DMA test buffers are 4 KB each, carve them out of one shared 2 MB
+  // arena instead of giving each its own huge page and IOMMU mapping
+  DMAMemoryAllocator::getInstance(m_fds.container_fd)
+      .setArenaMode(true, 2 * 1024 * 1024);
+
   return true;
 }
 
@@ -162,7 +167,7 @@ bool FPGADev::test_dma_write() {
   info("--- Test: DMA Write from FPGA to Host ---");
 
   // Get DMA memory allocator
-  DMAMemoryAllocator &allocator = DMAMemoryAllocator::getInstance();
+  DMAMemoryAllocator &allocator = DMAMemoryAllocator::getInstance(m_fds.container_fd);
 
   // =========================================================================
   // Test 1: Small DMA (4 DWords = 16 bytes) - fits in ONE beat
@@ -170,7 +175,7 @@ bool FPGADev::test_dma_write() {
   info("Test 1: Small DMA transfer (4 DWords, 1 beat)");
 
   // Allocate DMA buffer for small transfer
-  DMAMemoryPair small_buf = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair small_buf = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga small_buf");
   if (small_buf.virt == nullptr) {
     error("Failed to allocate small DMA buffer");
     return false;
@@ -237,7 +242,7 @@ bool FPGADev::test_dma_write() {
   info("Test 2: Large DMA transfer (12 DWords, 3 beats)");
 
   // Allocate DMA buffer for large transfer
-  DMAMemoryPair large_buf = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair large_buf = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga large_buf");
   if (large_buf.virt == nullptr) {
     error("Failed to allocate large DMA buffer");
     return false;
@@ -319,7 +324,7 @@ bool FPGADev::test_dma_write() {
 bool FPGADev::test_dma_roundtrip() {
   info("--- Test: DMA Round-Trip (Host -> FPGA -> Host) ---");
 
-  DMAMemoryAllocator &allocator = DMAMemoryAllocator::getInstance();
+  DMAMemoryAllocator &allocator = DMAMemoryAllocator::getInstance(m_fds.container_fd);
 
   // =========================================================================
   // Test 1: Small Round-Trip (4 DWords = 16 bytes)
@@ -327,14 +332,14 @@ bool FPGADev::test_dma_roundtrip() {
   info("Test 1: Small round-trip (4 DWords)");
 
   // Allocate source buffer and fill with test data
-  DMAMemoryPair src_small = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair src_small = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga src_small");
   if (src_small.virt == nullptr) {
     error("Failed to allocate small source buffer");
     return false;
   }
 
   // Allocate destination buffer and clear it
-  DMAMemoryPair dst_small = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair dst_small = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga dst_small");
   if (dst_small.virt == nullptr) {
     error("Failed to allocate small destination buffer");
     return false;
@@ -410,14 +415,14 @@ bool FPGADev::test_dma_roundtrip() {
   info("Test 2: Large round-trip (12 DWords)");
 
   // Allocate source buffer
-  DMAMemoryPair src_large = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair src_large = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga src_large");
   if (src_large.virt == nullptr) {
     error("Failed to allocate large source buffer");
     return false;
   }
 
   // Allocate destination buffer
-  DMAMemoryPair dst_large = allocator.allocDMAMemory(4096, m_fds.container_fd);
+  DMAMemoryPair dst_large = allocator.allocDMAMemory(4096, 4096, m_basic_para.numa_node, "fpga dst_large");
   if (dst_large.virt == nullptr) {
     error("Failed to allocate large destination buffer");
     return false;
@@ -0,0 +1,110 @@
+// cycles per packet the pkt_buf header costs on the rx path, the two cache line header it replaced against the current one.
+// before: 128 byte header, the data pointer in its second cache line. after: one cache line, payload at data_off.
+// every packet goes through fillDescRing (payload address into the descriptor), readDescriptors (metadata) and
+// the application (first payload byte). runs on plain memory, no device needed
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <x86intrin.h>
+#include "memory_pool.h"
+
+#define PKT_BUF_SIZE (2048 + 128)
+// 16384 x 2176 bytes spread the headers over more than the last level cache
+#define NUM_OF_BUF 16384
+#define ROUNDS 20
+
+// the header before the redesign, only the fields the rx path uses matter
+struct legacy_pkt_buf {
+	uintptr_t iova;
+	uint32_t idx;
+	uint32_t size;
+	DMAMemoryPool* pool;
+	uint16_t refcnt;
+	uint8_t head_room[32];
+	uint8_t* data __attribute__((aligned(64)));
+};
+static_assert(sizeof(struct legacy_pkt_buf) == 128, "the old header took two cache lines");
+
+static uint64_t bench_legacy(uint8_t* mem, volatile uint64_t* descs, uint32_t* p_sum){
+	uint32_t sum = 0;
+	uint64_t start = __rdtsc();
+	for (uint32_t round = 0; round < ROUNDS; round++) {
+		for (uint32_t i = 0; i < NUM_OF_BUF; i++) {
+			struct legacy_pkt_buf* buf = (struct legacy_pkt_buf*) (mem + (uint64_t) i * PKT_BUF_SIZE);
+			descs[i] = (uintptr_t) buf->data;
+		}
+		for (uint32_t i = 0; i < NUM_OF_BUF; i++) {
+			struct legacy_pkt_buf* buf = (struct legacy_pkt_buf*) (mem + (uint64_t) i * PKT_BUF_SIZE);
+			buf->size = 60;
+			sum += buf->data[0] + buf->size;
+		}
+	}
+	*p_sum = sum;
+	return __rdtsc() - start;
+}
+
+// metadata: also write the fields readDescriptors fills today, which the old header did not have
+static uint64_t bench_current(uint8_t* mem, volatile uint64_t* descs, uint16_t data_off, bool metadata, uint32_t* p_sum){
+	uint32_t sum = 0;
+	uint64_t start = __rdtsc();
+	for (uint32_t round = 0; round < ROUNDS; round++) {
+		for (uint32_t i = 0; i < NUM_OF_BUF; i++) {
+			struct pkt_buf* buf = (struct pkt_buf*) (mem + (uint64_t) i * PKT_BUF_SIZE);
+			// as fillDescRing does it, the header is only loaded
+			if (buf->data_off != data_off) {
+				buf->data_off = data_off;
+			}
+			descs[i] = (uintptr_t) buf->getData();
+		}
+		for (uint32_t i = 0; i < NUM_OF_BUF; i++) {
+			struct pkt_buf* buf = (struct pkt_buf*) (mem + (uint64_t) i * PKT_BUF_SIZE);
+			buf->size = 60;
+			if (metadata) {
+				buf->pkt_len = 60;
+				buf->port = 0;
+				buf->queue = 0;
+				buf->ol_flags = 0;
+				buf->timestamp = 0;
+			}
+			sum += buf->getData()[0] + buf->size;
+		}
+	}
+	*p_sum = sum;
+	return __rdtsc() - start;
+}
+
+int main() {
+	uint8_t* mem = (uint8_t*) aligned_alloc(4096, (size_t) NUM_OF_BUF * PKT_BUF_SIZE);
+	std::vector<uint64_t> descs(NUM_OF_BUF);
+	if (!mem) {
+		printf("out of memory\n");
+		return 1;
+	}
+	memset(mem, 0, (size_t) NUM_OF_BUF * PKT_BUF_SIZE);
+	for (uint32_t i = 0; i < NUM_OF_BUF; i++) {
+		struct legacy_pkt_buf* buf = (struct legacy_pkt_buf*) (mem + (uint64_t) i * PKT_BUF_SIZE);
+		buf->data = (uint8_t*) buf + sizeof(struct legacy_pkt_buf);
+	}
+	uint32_t sum_legacy, sum_current, sum_metadata;
+	bench_legacy(mem, descs.data(), &sum_legacy);
+	uint64_t legacy = bench_legacy(mem, descs.data(), &sum_legacy);
+
+	// the default headroom puts the payload at offset 128 as well
+	uint16_t data_off = sizeof(struct pkt_buf) + PKT_BUF_HEADROOM;
+	memset(mem, 0, (size_t) NUM_OF_BUF * PKT_BUF_SIZE);
+	bench_current(mem, descs.data(), data_off, false, &sum_current);
+	uint64_t current = bench_current(mem, descs.data(), data_off, false, &sum_current);
+	uint64_t metadata = bench_current(mem, descs.data(), data_off, true, &sum_metadata);
+
+	double packets = (double) ROUNDS * NUM_OF_BUF;
+	printf("cycles per packet, %u pkt_bufs of %u bytes (checksums %u/%u/%u)\n", NUM_OF_BUF, PKT_BUF_SIZE, sum_legacy,
+	       sum_current, sum_metadata);
+	printf("  before (2 line header, data pointer):     %8.2f\n", legacy / packets);
+	printf("  after  (1 line header, data_off):         %8.2f  saved %6.2f\n", current / packets,
+	       (legacy - (double) current) / packets);
+	printf("  after, with port/queue/flags/timestamp:   %8.2f  saved %6.2f\n", metadata / packets,
+	       (legacy - (double) metadata) / packets);
+	free(mem);
+	return 0;
+}
@@ -0,0 +1,68 @@
+// cycles per pkt_buf of the DMAMemoryPool alloc/free paths for batch sizes 1-256: the bulk calls
+// (popOutMultiPktBuf/freeMultiPktBuf), the single-buffer calls (popOutOnePktBufFromTop/freePktBuf) and the
+// refcounted release the rings use (releaseMultiPktBuf), plain and thread-safe.
+// the pool needs a VFIO container, so the device is bound but not initialized
+#include <cstdio>
+#include <string>
+#include <x86intrin.h>
+#include "vfio_dev.h"
+
+#define PKT_BUF_SIZE (2048 + 128)
+#define NUM_OF_BUF 4096
+#define ITERATIONS 20000
+
+typedef void (*pool_op)(DMAMemoryPool* pool, struct pkt_buf** bufs, uint32_t batch);
+
+static void bulk_op(DMAMemoryPool* pool, struct pkt_buf** bufs, uint32_t batch){
+	uint32_t got = pool->popOutMultiPktBuf(bufs, batch);
+	pool->freeMultiPktBuf(bufs, got);
+}
+
+static void single_op(DMAMemoryPool* pool, struct pkt_buf** bufs, uint32_t batch){
+	for (uint32_t i = 0; i < batch; i++) {
+		bufs[i] = pool->popOutOnePktBufFromTop();
+	}
+	for (uint32_t i = 0; i < batch; i++) {
+		pool->freePktBuf(bufs[i]);
+	}
+}
+
+static void release_op(DMAMemoryPool* pool, struct pkt_buf** bufs, uint32_t batch){
+	uint32_t got = pool->popOutMultiPktBuf(bufs, batch);
+	DMAMemoryPool::releaseMultiPktBuf(bufs, got);
+}
+
+// cycles per pkt_buf for one alloc and one free
+static double measure(DMAMemoryPool* pool, pool_op op, uint32_t batch){
+	struct pkt_buf* bufs[256];
+	// warm the free stack, the caches and the headers
+	for (uint32_t i = 0; i < 100; i++) {
+		op(pool, bufs, batch);
+	}
+	uint64_t start = __rdtsc();
+	for (uint32_t i = 0; i < ITERATIONS; i++) {
+		op(pool, bufs, batch);
+	}
+	uint64_t cycles = __rdtsc() - start;
+	return (double) cycles / ((uint64_t) ITERATIONS * batch);
+}
+
+int main(int argc, char* argv[]) {
+	if (argc != 2) {
+		printf("Usage: %s <pci address, e.g. 0000:05:00.0>\n", argv[0]);
+		return 1;
+	}
+	Intel82599Dev dev(argv[1], 0);
+	DMAMemoryPool pool(NUM_OF_BUF, PKT_BUF_SIZE, dev.getContainerFD(), dev.getNumaNode(), "bench pool");
+	for (bool thread_safe : {false, true}) {
+		pool.setThreadSafe(thread_safe);
+		printf("%s pool, cycles per pkt_buf (alloc + free)\n", thread_safe ? "thread-safe" : "single-thread");
+		printf("%6s %10s %10s %10s\n", "batch", "bulk", "single", "release");
+		for (uint32_t batch = 1; batch <= 256; batch *= 2) {
+			printf("%6u %10.2f %10.2f %10.2f\n", batch, measure(&pool, bulk_op, batch), measure(&pool, single_op, batch),
+			       measure(&pool, release_op, batch));
+		}
+	}
+	pool.setThreadSafe(false);
+	return 0;
+}
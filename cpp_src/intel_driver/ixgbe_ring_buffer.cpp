@@ -2,9 +2,72 @@
 #include "device.h"
 #include "log.h"
 #include <sys/epoll.h>
+#include <time.h>
+#include <algorithm>
+#ifdef RX_VEC_BURST
+#include <immintrin.h>
+#endif
 #define wrap_ring(index, ring_size) (uint16_t) ((index + 1) & (ring_size - 1))
 using namespace std;
 
+static inline uint64_t clockNs(clockid_t clock_id){
+	struct timespec ts;
+	clock_gettime(clock_id, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+void IXGBE_TimeCounter::init(uint8_t* BAR_addr, uint32_t shift, std::mutex* rx_stamp_lock){
+	p_bar_addr = BAR_addr;
+	p_rx_stamp_lock = rx_stamp_lock;
+	m_shift = shift;
+	m_frac = 0;
+	m_ns_last = clockNs(CLOCK_REALTIME);
+	m_cycle_last = readCycles();
+	m_mono_last = clockNs(CLOCK_MONOTONIC_COARSE);
+}
+
+uint64_t IXGBE_TimeCounter::readCycles() const{
+	uint64_t low = get_bar_reg32(p_bar_addr, IXGBE_SYSTIML);
+	return ((uint64_t) get_bar_reg32(p_bar_addr, IXGBE_SYSTIMH) << 32) | low;
+}
+
+uint64_t IXGBE_TimeCounter::updateNs(uint64_t cycles){
+	uint64_t mask = (1ull << m_shift) - 1;
+	uint64_t delta = cycles - m_cycle_last;
+	uint64_t ns = (delta >> m_shift) + (((delta & mask) + m_frac) >> m_shift);
+	m_frac = ((delta & mask) + m_frac) & mask;
+	// SYSTIM wrapped unseen if more time passed than the delta accounts for, add the missed wraps
+	uint64_t mono = clockNs(CLOCK_MONOTONIC_COARSE);
+	uint64_t wrap_ns = 1ull << (64 - m_shift);
+	uint64_t elapsed = mono - m_mono_last;
+	if (elapsed > ns + wrap_ns / 2) {
+		ns += (elapsed - ns + wrap_ns / 2) / wrap_ns * wrap_ns;
+	}
+	m_ns_last += ns;
+	m_cycle_last = cycles;
+	m_mono_last = mono;
+	return m_ns_last;
+}
+
+uint64_t IXGBE_TimeCounter::toNs(uint64_t cycles) const{
+	uint64_t behind = m_cycle_last - cycles;
+	if (behind <= (1ull << 63)) {
+		return behind > m_frac ? m_ns_last - ((behind - m_frac) >> m_shift) : m_ns_last;
+	}
+	return m_ns_last + ((cycles - m_cycle_last + m_frac) >> m_shift);
+}
+
+bool IXGBE_TimeCounter::readRxStamp(uint64_t* p_cycles) const{
+	// another ring reading RXSTMPH between the two reads frees the latch, the high half would be the next packet's
+	std::lock_guard<std::mutex> guard(*p_rx_stamp_lock);
+	if (!(get_bar_reg32(p_bar_addr, IXGBE_TSYNCRXCTL) & IXGBE_TSYNCRXCTL_VALID)) {
+		return false;
+	}
+	uint64_t low = get_bar_reg32(p_bar_addr, IXGBE_RXSTMPL);
+	*p_cycles = ((uint64_t) get_bar_reg32(p_bar_addr, IXGBE_RXSTMPH) << 32) | low;
+	return true;
+}
+
 
 
 
@@ -20,8 +83,24 @@ bool IXGBE_RxRingBuffer::_bindDescMemVirt(){
 
 bool IXGBE_RxRingBuffer::linkMemoryPool(DMAMemoryPool* const mem_pool){
 	p_mem_pool = mem_pool;
-	m_num_buf = mem_pool->getNumOfBufs();
 	if (!p_mem_pool) return false;
+	m_num_buf = mem_pool->getNumOfBufs();
+	m_iova_is_va = mem_pool->isIOVAEqualVA();
+	return true;
+}
+
+bool IXGBE_RxRingBuffer::linkHeaderPool(DMAMemoryPool* const hdr_pool){
+	if (p_desc_ring_start) {
+		warn("header pool has to be linked before the descriptor ring is created");
+		return false;
+	}
+	if (hdr_pool->getDataRoom() % 64 || hdr_pool->getDataRoom() > 1024 || hdr_pool->isIOVAEqualVA() != m_iova_is_va) {
+		warn("header pool with a data room of %u bytes cannot be used for header split", hdr_pool->getDataRoom());
+		return false;
+	}
+	p_hdr_pool = hdr_pool;
+	delete[] a_hdr_buf_addr;
+	a_hdr_buf_addr = new pkt_buf*[hdr_pool->getNumOfBufs()]();
 	return true;
 };
 
@@ -37,8 +116,12 @@ int IXGBE_RxRingBuffer::vfio_epoll_wait(int epoll_fd, uint16_t timeout){
 			/* epoll_wait has at least one fd ready to read */
 			for (int i = 0; i < rc; i++) {
 				uint64_t val;
-				// read event file descriptor to clear interrupt.
-				check_err(read(events[i].data.fd, &val, sizeof(val)), "to read event");
+				// read event file descriptor to clear interrupt. the fds are non-blocking and may be shared with a
+				// QueueEventLoop, which can have consumed the event already
+				ssize_t ret = read(events[i].data.fd, &val, sizeof(val));
+				if (ret != -1 || errno != EAGAIN) {
+					check_err(ret, "to read event");
+				}
 			}
 			break;
 		} else {
@@ -51,34 +134,243 @@ int IXGBE_RxRingBuffer::vfio_epoll_wait(int epoll_fd, uint16_t timeout){
 
 
 uint16_t IXGBE_RxRingBuffer::readDescriptors(uint16_t batch_size, struct pkt_buf** bufs){
-	uint16_t rx_index = m_desc_head; // rx index we checked in the last run of this function
-	uint32_t buf_index;
-	for (buf_index = 0; buf_index < batch_size; buf_index++) {
-		if (rx_index == m_desc_tail) {
-			// no more descriptors to read
+	uint16_t num = 0;
+#ifdef RX_VEC_BURST
+	// a frame received partially in the last call is completed by the scalar path first, split frames are
+	// always assembled there
+	if (m_vector_rx && !p_rx_chain_head && !p_hdr_pool) {
+		num = _readDescriptorsVec(batch_size, bufs);
+	}
+#endif
+	// the rest of the batch: the tail of the ring, multi-segment frames or the first descriptor not done yet
+	if (num < batch_size) {
+		num += _readDescriptorsScalar(batch_size - num, bufs + num);
+	}
+	m_stats.rx_pkts += num;
+	if (m_time_counter.isEnabled()) {
+		_setTimestamps(num, bufs);
+	}
+	return num;
+}
+
+void IXGBE_RxRingBuffer::attachMemory(union ixgbe_adv_rx_desc* desc_ring, struct pkt_buf* const* bufs, uint32_t num_desc,
+                                      uint16_t head){
+	m_num_desc = num_desc;
+	m_size_desc = sizeof(union ixgbe_adv_rx_desc);
+	p_desc_ring_start = desc_ring;
+	delete[] a_linked_buf_addr;
+	a_linked_buf_addr = new pkt_buf*[num_desc];
+	std::copy(bufs, bufs + num_desc, a_linked_buf_addr);
+	m_desc_head = head;
+	m_desc_tail = (uint16_t) ((head - 1) & (num_desc - 1));
+	p_rx_chain_head = nullptr;
+	p_rx_chain_tail = nullptr;
+}
+
+bool IXGBE_RxRingBuffer::isHeadDone() const{
+	if (m_desc_head == m_desc_tail) {
+		return false;
+	}
+	return p_desc_ring_start[m_desc_head].wb.upper.status_error & IXGBE_RXDADV_STAT_DD;
+}
+
+void IXGBE_RxRingBuffer::_setTimestamps(uint16_t num_bufs, struct pkt_buf** bufs){
+	if (!num_bufs) {
+		return;
+	}
+	// one SYSTIM read for the whole batch, the packets were received between the last call and now
+	uint64_t now = m_time_counter.updateNs(m_time_counter.readCycles());
+	for (uint16_t i = 0; i < num_bufs; i++) {
+		struct pkt_buf* buf = bufs[i];
+		buf->timestamp = now;
+		buf->ol_flags |= PKT_RX_TIMESTAMP | PKT_RX_TIMESTAMP_BATCH;
+		// the nic latches a single rx stamp at a time, it belongs to the packet whose descriptor reports TS
+		uint64_t cycles;
+		if (buf->ol_flags & PKT_RX_IEEE1588_TMST) {
+			if (m_time_counter.readRxStamp(&cycles)) {
+				buf->timestamp = m_time_counter.toNs(cycles);
+				buf->ol_flags &= ~PKT_RX_TIMESTAMP_BATCH;
+			} else {
+				buf->ol_flags &= ~PKT_RX_IEEE1588_TMST;
+			}
+		}
+	}
+}
+
+// translates the write-back of the last descriptor of a frame into the metadata of its first pkt_buf
+static inline void setRxOffloads(struct pkt_buf* buf, uint32_t status_error, uint32_t pkt_info, uint32_t rss,
+                                 uint16_t vlan, bool vlan_strip){
+	uint32_t ol_flags = 0;
+	// the hash dword holds the filter id instead of the RSS hash after a flow director match
+	if (status_error & IXGBE_RXDADV_STAT_FLM) {
+		ol_flags |= PKT_RX_FDIR;
+	} else if (pkt_info & IXGBE_RXDADV_RSSTYPE_MASK) {
+		ol_flags |= PKT_RX_RSS_HASH;
+	}
+	if (status_error & IXGBE_RXDADV_STAT_VP) {
+		ol_flags |= vlan_strip ? PKT_RX_VLAN | PKT_RX_VLAN_STRIPPED : PKT_RX_VLAN;
+	}
+	if (status_error & IXGBE_RXD_STAT_IPCS) {
+		ol_flags |= (status_error & IXGBE_RXDADV_ERR_IPE) ? PKT_RX_IP_CKSUM_BAD : PKT_RX_IP_CKSUM_GOOD;
+	}
+	if (status_error & IXGBE_RXD_STAT_L4CS) {
+		ol_flags |= (status_error & IXGBE_RXDADV_ERR_TCPE) ? PKT_RX_L4_CKSUM_BAD : PKT_RX_L4_CKSUM_GOOD;
+	}
+	if (status_error & IXGBE_RXDADV_STAT_TS) {
+		ol_flags |= PKT_RX_IEEE1588_TMST;
+	}
+	buf->ol_flags = ol_flags;
+	buf->packet_type = (uint16_t) ((pkt_info & IXGBE_RXDADV_PKTTYPE_MASK) >> 4) & 0x7F;
+	buf->vlan_tci = (ol_flags & PKT_RX_VLAN_STRIPPED) ? vlan : 0;
+	buf->rss_hash = rss;
+}
+
+#ifdef RX_VEC_BURST
+uint16_t IXGBE_RxRingBuffer::_readDescriptorsVec(uint16_t batch_size, struct pkt_buf** bufs){
+	uint16_t rx_index = m_desc_head;
+	// descriptors behind the tail still hold the write-back of their last use
+	uint16_t avail = (uint16_t) ((m_desc_tail - rx_index) & (m_num_desc - 1));
+	uint16_t num = 0;
+	// the four dwords of every write-back descriptor, gathered per field
+	alignas(32) uint32_t pkt_infos[RX_VEC_BURST];
+	alignas(32) uint32_t hashes[RX_VEC_BURST];
+	alignas(32) uint32_t statuses[RX_VEC_BURST];
+	alignas(32) uint32_t lengths[RX_VEC_BURST];     // length | vlan << 16
+	while (num + RX_VEC_BURST <= batch_size && avail >= RX_VEC_BURST && (uint32_t) rx_index + RX_VEC_BURST <= m_num_desc) {
+		// the descriptors are written by the nic, they have to be loaded again in every step
+		asm volatile("" ::: "memory");
+		const uint8_t* desc = (const uint8_t*) (p_desc_ring_start + rx_index);
+		// packet info and hash in the lower, status_error and length/vlan in the upper 8 bytes of every write-back
+		// descriptor. bit 0 (DD) and bit 1 (EOP) of the status words are shifted into the sign bits for movemask
+#if defined(__AVX2__)
+		__m256i v01 = _mm256_loadu_si256((const __m256i*) (desc + 0));
+		__m256i v23 = _mm256_loadu_si256((const __m256i*) (desc + 32));
+		__m256i v45 = _mm256_loadu_si256((const __m256i*) (desc + 64));
+		__m256i v67 = _mm256_loadu_si256((const __m256i*) (desc + 96));
+		// per 128 bit lane: descriptors 0 2 | 1 3 and 4 6 | 5 7
+		__m256 lo0 = _mm256_castsi256_ps(_mm256_unpacklo_epi64(v01, v23));
+		__m256 lo1 = _mm256_castsi256_ps(_mm256_unpacklo_epi64(v45, v67));
+		__m256 hi0 = _mm256_castsi256_ps(_mm256_unpackhi_epi64(v01, v23));
+		__m256 hi1 = _mm256_castsi256_ps(_mm256_unpackhi_epi64(v45, v67));
+		// the shuffles leave the descriptors in the order 0 2 4 6 1 3 5 7
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+		__m256i status = _mm256_permutevar8x32_epi32(_mm256_castps_si256(_mm256_shuffle_ps(hi0, hi1, _MM_SHUFFLE(2, 0, 2, 0))), order);
+		__m256i length = _mm256_permutevar8x32_epi32(_mm256_castps_si256(_mm256_shuffle_ps(hi0, hi1, _MM_SHUFFLE(3, 1, 3, 1))), order);
+		__m256i pkt_info = _mm256_permutevar8x32_epi32(_mm256_castps_si256(_mm256_shuffle_ps(lo0, lo1, _MM_SHUFFLE(2, 0, 2, 0))), order);
+		__m256i hash = _mm256_permutevar8x32_epi32(_mm256_castps_si256(_mm256_shuffle_ps(lo0, lo1, _MM_SHUFFLE(3, 1, 3, 1))), order);
+		_mm256_store_si256((__m256i*) statuses, status);
+		_mm256_store_si256((__m256i*) lengths, length);
+		_mm256_store_si256((__m256i*) pkt_infos, pkt_info);
+		_mm256_store_si256((__m256i*) hashes, hash);
+		uint32_t dd_mask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(status, 31)));
+		uint32_t eop_mask = (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_slli_epi32(status, 30)));
+#else
+		__m128i v0 = _mm_loadu_si128((const __m128i*) (desc + 0));
+		__m128i v1 = _mm_loadu_si128((const __m128i*) (desc + 16));
+		__m128i v2 = _mm_loadu_si128((const __m128i*) (desc + 32));
+		__m128i v3 = _mm_loadu_si128((const __m128i*) (desc + 48));
+		__m128 lo0 = _mm_castsi128_ps(_mm_unpacklo_epi64(v0, v1));
+		__m128 lo1 = _mm_castsi128_ps(_mm_unpacklo_epi64(v2, v3));
+		__m128 hi0 = _mm_castsi128_ps(_mm_unpackhi_epi64(v0, v1));
+		__m128 hi1 = _mm_castsi128_ps(_mm_unpackhi_epi64(v2, v3));
+		__m128i status = _mm_castps_si128(_mm_shuffle_ps(hi0, hi1, _MM_SHUFFLE(2, 0, 2, 0)));
+		_mm_store_si128((__m128i*) statuses, status);
+		_mm_store_si128((__m128i*) lengths, _mm_castps_si128(_mm_shuffle_ps(hi0, hi1, _MM_SHUFFLE(3, 1, 3, 1))));
+		_mm_store_si128((__m128i*) pkt_infos, _mm_castps_si128(_mm_shuffle_ps(lo0, lo1, _MM_SHUFFLE(2, 0, 2, 0))));
+		_mm_store_si128((__m128i*) hashes, _mm_castps_si128(_mm_shuffle_ps(lo0, lo1, _MM_SHUFFLE(3, 1, 3, 1))));
+		uint32_t dd_mask = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(status, 31)));
+		uint32_t eop_mask = (uint32_t) _mm_movemask_ps(_mm_castsi128_ps(_mm_slli_epi32(status, 30)));
+#endif
+		// complete single-segment frames from the first descriptor on, the nic writes back in order
+		uint32_t done = (uint32_t) __builtin_ctz(~(dd_mask & eop_mask));
+		for (uint32_t i = 0; i < done; i++) {
+			struct pkt_buf* buf = a_linked_buf_addr[rx_index + i];
+			buf->size = (uint16_t) lengths[i];
+			buf->pkt_len = lengths[i] & 0xFFFF;
+			m_stats.rx_bytes += buf->pkt_len;
+			buf->nb_segs = 1;
+			buf->port = m_port_id;
+			buf->queue = m_ring_index;
+			setRxOffloads(buf, statuses[i], pkt_infos[i], hashes[i], (uint16_t) (lengths[i] >> 16), m_vlan_strip);
+			buf->timestamp = 0;
+			bufs[num + i] = buf;
+		}
+		num += done;
+		avail -= done;
+		rx_index = (uint16_t) ((rx_index + done) & (m_num_desc - 1));
+		if (done < RX_VEC_BURST) {
 			break;
 		}
+	}
+	m_desc_head = rx_index;
+	return num;
+}
+#endif
+
+uint16_t IXGBE_RxRingBuffer::_readDescriptorsScalar(uint16_t batch_size, struct pkt_buf** bufs){
+	uint16_t rx_index = m_desc_head; // rx index we checked in the last run of this function
+	uint32_t buf_index = 0;
+	while (buf_index < batch_size && rx_index != m_desc_tail) {
 		volatile union ixgbe_adv_rx_desc* desc_ptr = p_desc_ring_start + rx_index;
 		uint32_t status = desc_ptr->wb.upper.status_error;
-		if (status & IXGBE_RXDADV_STAT_DD) {
-			if (!(status & IXGBE_RXDADV_STAT_EOP)) {
-				error("multi-segment packets are not supported - increase buffer size or decrease MTU");
+		if (!(status & IXGBE_RXDADV_STAT_DD)) {
+			break;
+		}
+		// got a segment, chain it to the frame it belongs to
+		struct pkt_buf* buf = (struct pkt_buf*) a_linked_buf_addr[rx_index];
+		buf->size = desc_ptr->wb.upper.length;
+		// only the first descriptor of a frame uses its header buffer
+		uint16_t hdr_info = p_hdr_pool && !p_rx_chain_head ? desc_ptr->wb.lower.lo_dword.hs_rss.hdr_info : 0;
+		uint16_t hdr_len = (hdr_info & IXGBE_RXDADV_HDRBUFLEN_MASK) >> IXGBE_RXDADV_HDRBUFLEN_SHIFT;
+		if ((hdr_info & IXGBE_RXDADV_SPH) && hdr_len && !(status & IXGBE_RXDADV_ERR_HBO)) {
+			struct pkt_buf* hdr = a_hdr_buf_addr[rx_index];
+			a_hdr_buf_addr[rx_index] = nullptr;
+			hdr->size = hdr_len;
+			hdr->pkt_len = hdr_len + buf->size;
+			hdr->nb_segs = 2;
+			if (buf->size) {
+				hdr->next = buf;
+				p_rx_chain_tail = buf;
+			} else {
+				// everything fit into the header buffer
+				p_mem_pool->freePktBuf(buf);
+				hdr->nb_segs = 1;
+				p_rx_chain_tail = hdr;
 			}
-			// got a packet, read and copy the whole descriptor
-			struct pkt_buf* buf = (struct pkt_buf*) a_linked_buf_addr[rx_index];
-			buf->size = desc_ptr->wb.upper.length;
-			// this would be the place to implement RX offloading by translating the device-specific flags
-
-
-			bufs[buf_index] = buf;
-			// want to read the next one in the next iteration, but we still need the last/current to update RDT later
-			rx_index = wrap_ring(rx_index, m_num_desc);
+			p_rx_chain_head = hdr;
+		} else if (!p_rx_chain_head) {
+			p_rx_chain_head = buf;
+			p_rx_chain_tail = buf;
+			buf->pkt_len = buf->size;
+			buf->nb_segs = 1;
 		} else {
-			break;
+			p_rx_chain_tail->next = buf;
+			p_rx_chain_tail = buf;
+			p_rx_chain_head->pkt_len += buf->size;
+			p_rx_chain_head->nb_segs++;
 		}
+		// want to read the next one in the next iteration, but we still need the last/current to update RDT later
+		rx_index = wrap_ring(rx_index, m_num_desc);
+		if (!(status & IXGBE_RXDADV_STAT_EOP)) {
+			// the frame continues in the next descriptor, maybe written back only after this call
+			continue;
+		}
+		buf = p_rx_chain_head;
+		buf->port = m_port_id;
+		buf->queue = m_ring_index;
+		// the offload results are reported in the last descriptor of the frame
+		setRxOffloads(buf, status, desc_ptr->wb.lower.lo_dword.data, desc_ptr->wb.lower.hi_dword.rss,
+		              desc_ptr->wb.upper.vlan, m_vlan_strip);
+		if (p_hdr_pool && buf->pool == p_hdr_pool) {
+			buf->ol_flags |= PKT_RX_HDR_SPLIT;
+		}
+		buf->timestamp = 0;
+		m_stats.rx_bytes += buf->pkt_len;
+		bufs[buf_index++] = buf;
+		p_rx_chain_head = nullptr;
 	}
 	m_desc_head = rx_index;
-	return buf_index; // number of packets read (buf_index++ has been done if "break" is not hit)
+	return buf_index; // number of packets read
 };
 
 uint16_t IXGBE_RxRingBuffer::fillDescRing(uint16_t batch_size){
@@ -91,35 +383,113 @@ uint16_t IXGBE_RxRingBuffer::fillDescRing(uint16_t batch_size){
 		error("descriptor ring not linked to DMA memory, call bindDMAMemVirtWithDesc first");
 		return m_desc_tail;
 	}
+	uint16_t data_off = p_mem_pool->getDataOffset();
+	uint16_t hdr_data_off = p_hdr_pool ? p_hdr_pool->getDataOffset() : 0;
 	while (linked < batch_size) {
-		uint16_t next_index = wrap_ring(m_desc_tail, m_num_desc);
-		if (next_index == m_desc_head) {
+		// one descriptor always stays empty, otherwise a full ring would look like an empty one
+		uint16_t free_desc = (uint16_t) ((m_desc_head - m_desc_tail - 1) & (m_num_desc - 1));
+		// the pool copies straight into the shadow array, at most up to the end of the ring per round
+		uint32_t num = std::min<uint32_t>({(uint32_t) (batch_size - linked), free_desc, m_num_desc - m_desc_tail});
+		if (!num) {
 			// ring full
 			break;
 		}
-		struct pkt_buf* buf = p_mem_pool->popOutOnePktBufFromTop();
-		if (!buf) {
-			error("failed to allocate rx descriptor");
+		uint32_t got = p_mem_pool->popOutMultiPktBuf(a_linked_buf_addr + m_desc_tail, num);
+		for (uint32_t i = 0; i < got; i++) {
+			struct pkt_buf* buf = a_linked_buf_addr[m_desc_tail + i];
+			volatile union ixgbe_adv_rx_desc* rxd = p_desc_ring_start + m_desc_tail + i;
+			// the previous owner may have moved the payload start, e.g. to prepend a header. usually it did not,
+			// and a load keeps the header clean until readDescriptors writes it anyway
+			if (buf->data_off != data_off) {
+				buf->data_off = data_off;
+			}
+			if (m_iova_is_va) {
+				rxd->read.pkt_addr = (uintptr_t) buf->getData();
+			} else {
+				rxd->read.pkt_addr = buf->getDataIOVA();
+			}
+			if (!p_hdr_pool) {
+				rxd->read.hdr_addr = 0;
+				continue;
+			}
+			// a header buffer the nic did not use stays with its descriptor
+			struct pkt_buf*& hdr = a_hdr_buf_addr[m_desc_tail + i];
+			if (!hdr && !(hdr = p_hdr_pool->popOutOnePktBufFromTop())) {
+				p_mem_pool->freeMultiPktBuf(a_linked_buf_addr + m_desc_tail + i, got - i);
+				got = i;
+				break;
+			}
+			if (hdr->data_off != hdr_data_off) {
+				hdr->data_off = hdr_data_off;
+			}
+			if (m_iova_is_va) {
+				rxd->read.hdr_addr = (uintptr_t) hdr->getData();
+			} else {
+				rxd->read.hdr_addr = hdr->getDataIOVA();
+			}
+		}
+		m_desc_tail = (uint16_t) ((m_desc_tail + got) & (m_num_desc - 1));
+		linked += got;
+		if (got < num) {
+			// the pkt_bufs are still in use elsewhere, the descriptors stay empty until the next refill
+			if (m_stats.alloc_failed++ == 0) {
+				warn("rx pool ran dry, %u descriptors left empty, further shortfalls are only counted",
+				     (uint32_t) (batch_size - linked));
+			}
 			break;
 		}
-		volatile union ixgbe_adv_rx_desc* rxd = p_desc_ring_start + m_desc_tail;
-		uintptr_t data_offset = (uintptr_t)(buf->data - (uint8_t*)buf);
-		rxd->read.pkt_addr = buf->iova + data_offset;
-		rxd->read.hdr_addr = 0;
-		a_linked_buf_addr[m_desc_tail] = buf;
-		m_desc_tail = next_index;
-		linked++;
 	}
 	return m_desc_tail;
 };
 
 
+uint16_t IXGBE_RxRingBuffer::refillDescRing(){
+	uint16_t free_desc = (uint16_t) ((m_desc_head - m_desc_tail - 1) & (m_num_desc - 1));
+	if (free_desc < m_rx_free_thresh || !p_tail_reg) {
+		return 0;
+	}
+	uint16_t old_tail = m_desc_tail;
+	fillDescRing(free_desc);
+	uint16_t refilled = (uint16_t) ((m_desc_tail - old_tail) & (m_num_desc - 1));
+	if (refilled) {
+		// one uncached write for the whole refill, the descriptors are written before it
+		__asm__ volatile ("" : : : "memory");
+		*p_tail_reg = m_desc_tail;
+		m_stats.refilled += refilled;
+		m_stats.doorbells++;
+	}
+	return refilled;
+}
+
+bool IXGBE_RxRingBuffer::setRxFreeThresh(uint16_t rx_free_thresh){
+	if (!rx_free_thresh || (m_num_desc && rx_free_thresh >= m_num_desc)) {
+		warn("rx_free_thresh %u out of range [1, %u)", rx_free_thresh, m_num_desc);
+		return false;
+	}
+	m_rx_free_thresh = rx_free_thresh;
+	return true;
+}
+
 bool IXGBE_RxRingBuffer::_bindDescMemIOVA(uint8_t* BAR_addr, uint8_t ring_index){
 		// enable advanced rx descriptors, we could also get away with legacy descriptors, but they aren't really easier
 		set_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index), (get_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index)) & ~IXGBE_SRRCTL_DESCTYPE_MASK) | IXGBE_SRRCTL_DESCTYPE_ADV_ONEBUF);
 		// drop_en causes the nic to drop packets if no rx descriptors are available instead of buffering them
 		// a single overflowing queue can fill up the whole buffer and impact operations if not setting this flag
 		set_bar_flags32(BAR_addr, IXGBE_SRRCTL(ring_index), IXGBE_SRRCTL_DROP_EN);
+		// the nic fills at most BSIZEPKT (1KB units) per descriptor and continues larger frames in the next one,
+		// so it has to match the data room of the pool, the default of 2KB would overrun smaller buffers
+		uint32_t bsizepkt = std::min<uint32_t>(p_mem_pool->getDataRoom() >> IXGBE_SRRCTL_BSIZEPKT_SHIFT, 16);
+		if (!bsizepkt) {
+			error("pkt_buf data room of %u bytes is below the 1KB minimum of the nic", p_mem_pool->getDataRoom());
+			return false;
+		}
+		set_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index), (get_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index)) & ~IXGBE_SRRCTL_BSIZEPKT_MASK) | bsizepkt);
+		if (p_hdr_pool) {
+			// split the headers selected by PSRTYPE into the header buffer, BSIZEHEADER is in 64 byte units as well
+			uint32_t srrctl = get_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index)) & ~(IXGBE_SRRCTL_DESCTYPE_MASK | IXGBE_SRRCTL_BSIZEHDR_MASK);
+			srrctl |= IXGBE_SRRCTL_DESCTYPE_HDR_SPLIT | (p_hdr_pool->getDataRoom() << IXGBE_SRRCTL_BSIZEHDRSIZE_SHIFT);
+			set_bar_reg32(BAR_addr, IXGBE_SRRCTL(ring_index), srrctl);
+		}
 		// tell the device where it can write to (its iova, so its view)
 		// neat trick from Snabb: initialize to 0xFF to prevent rogue memory accesses on premature DMA activation
 		set_bar_reg32(BAR_addr, IXGBE_RDBAL(ring_index), (uint32_t) (m_desc_mem_pair.iova & 0xFFFFFFFFull));
@@ -128,6 +498,7 @@ bool IXGBE_RxRingBuffer::_bindDescMemIOVA(uint8_t* BAR_addr, uint8_t ring_index)
 		// set ring to empty at start
 		set_bar_reg32(BAR_addr, IXGBE_RDH(ring_index), 0);
 		set_bar_reg32(BAR_addr, IXGBE_RDT(ring_index), 0);
+		p_tail_reg = (volatile uint32_t*) (BAR_addr + IXGBE_RDT(ring_index));
 		return true;
 };
 
@@ -139,16 +510,13 @@ IXGBE_TxRingBuffer::~IXGBE_TxRingBuffer(){
 		delete[] a_used_buf_addr;
 		a_used_buf_addr = nullptr;
 	}
-	if (a_linked_buf_addr){
-		delete[] a_linked_buf_addr;
-		a_linked_buf_addr = nullptr;
-	}
 };
 
 bool IXGBE_TxRingBuffer::linkMemoryPool(DMAMemoryPool* const mem_pool){
 	p_mem_pool = mem_pool;
-	m_num_buf = mem_pool->getNumOfBufs();
 	if (!p_mem_pool) return false;
+	m_num_buf = mem_pool->getNumOfBufs();
+	m_iova_is_va = mem_pool->isIOVAEqualVA();
 	a_used_buf_addr = new pkt_buf*[m_num_buf]();
 	return true;
 }
@@ -189,32 +557,45 @@ uint16_t IXGBE_TxRingBuffer::linkPktWithDesc(uint16_t batch_size){
 	}
 	uint16_t linked = 0;
 	while (buf && linked < batch_size) {
-		uint16_t next_index = wrap_ring(m_desc_tail, m_num_desc);
-		if (next_index == m_desc_head) {
+		// one descriptor per segment, one descriptor always stays empty
+		uint16_t free_desc = (uint16_t) ((m_desc_head - m_desc_tail - 1) & (m_num_desc - 1));
+		if (buf->nb_segs > free_desc) {
 			// ring full, return buffer to pool (can't push back to FIFO front)
-			p_mem_pool->freePktBuf(buf);
+			DMAMemoryPool::releasePktBuf(buf);
 			// Also return any remaining buffers in the used queue back to pool
 			while ((buf = getUsedBufAddr()) != nullptr) {
-				p_mem_pool->freePktBuf(buf);
+				DMAMemoryPool::releasePktBuf(buf);
 			}
 			return m_desc_tail;
 		}
-		// Track buffer at the descriptor index AFTER confirming ring has space
-		a_linked_buf_addr[m_desc_tail] = buf;
-		volatile union ixgbe_adv_tx_desc* txd = p_desc_ring_start + m_desc_tail;
-		
-		// NIC reads from here
-		uintptr_t data_offset = (uintptr_t)(buf->data - (uint8_t*) buf);
-		txd->read.buffer_addr = buf->iova + data_offset;
-		// always the same flags: one buffer (EOP), advanced data descriptor, CRC offload, data length
-		txd->read.cmd_type_len =
-			IXGBE_ADVTXD_DCMD_EOP | IXGBE_ADVTXD_DCMD_RS | IXGBE_ADVTXD_DCMD_IFCS | IXGBE_ADVTXD_DCMD_DEXT | IXGBE_ADVTXD_DTYP_DATA | buf->size;
-		// no fancy offloading stuff - only the total payload length
+		// no fancy offloading stuff - only the total payload length, repeated in every descriptor of the packet
 		// implement offloading flags here:
 		// 	* ip checksum offloading is trivial: just set the offset
 		// 	* tcp/udp checksum offloading is more annoying, you have to precalculate the pseudo-header checksum
-		txd->read.olinfo_status = buf->size << IXGBE_ADVTXD_PAYLEN_SHIFT;
-		m_desc_tail = next_index;
+		uint32_t olinfo_status = (buf->next ? buf->pkt_len : buf->size) << IXGBE_ADVTXD_PAYLEN_SHIFT;
+		for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+			volatile union ixgbe_adv_tx_desc* txd = p_desc_ring_start + m_desc_tail;
+			// NIC reads from here
+			if (m_iova_is_va) {
+				txd->read.buffer_addr = (uintptr_t) seg->getData();
+			} else {
+				txd->read.buffer_addr = seg->getDataIOVA();
+			}
+			// advanced data descriptor, CRC offload, data length of the segment. only the last one ends the
+			// packet (EOP) and asks for a write-back (RS)
+			uint32_t cmd_type_len = IXGBE_ADVTXD_DCMD_IFCS | IXGBE_ADVTXD_DCMD_DEXT | IXGBE_ADVTXD_DTYP_DATA | seg->size;
+			if (buf->ol_flags & PKT_TX_IEEE1588_TMST) {
+				cmd_type_len |= IXGBE_ADVTXD_MAC_TSTAMP;
+			}
+			if (!seg->next) {
+				cmd_type_len |= IXGBE_ADVTXD_DCMD_EOP | IXGBE_ADVTXD_DCMD_RS;
+			}
+			txd->read.cmd_type_len = cmd_type_len;
+			txd->read.olinfo_status = olinfo_status;
+			// the whole chain is tracked at its last descriptor, it is released once that one is done
+			a_linked_buf_addr[m_desc_tail] = seg->next ? nullptr : buf;
+			m_desc_tail = wrap_ring(m_desc_tail, m_num_desc);
+		}
 		buf = getUsedBufAddr();
 		linked++;
 	}
@@ -239,15 +620,19 @@ bool IXGBE_TxRingBuffer::fillPktBuf (const char* data, uint32_t size) {
 		// error("failed to allocate pkt_buf from mempool");
 		return false;
 	}
-	if (size > p_mem_pool->getBufSize() - sizeof(struct pkt_buf)) {
-		warn("data size %u exceeds pkt_buf capacity %zu, truncating",
+	if (size > p_mem_pool->getDataRoom()) {
+		warn("data size %u exceeds pkt_buf capacity %u, truncating",
 		     size,
-		     p_mem_pool->getBufSize() - sizeof(struct pkt_buf));
-		size = p_mem_pool->getBufSize() - sizeof(struct pkt_buf);
+		     p_mem_pool->getDataRoom());
+		size = p_mem_pool->getDataRoom();
 	}
-	memcpy(buf->data, data, size);
-	buf->size = size;
-	*(uint16_t*) (buf->data + 24) = _calcIPChecksum(buf->data + 14, 20);
+	buf->data_off = p_mem_pool->getDataOffset();
+	uint8_t* data_ptr = buf->getData();
+	memcpy(data_ptr, data, size);
+	buf->size = (uint16_t) size;
+	buf->pkt_len = size;
+	buf->ol_flags = 0;
+	*(uint16_t*) (data_ptr + 24) = _calcIPChecksum(data_ptr + 14, 20);
 	if (setUsedBufAddr(buf) == false) {
 		p_mem_pool->freePktBuf(buf);
 		error("failed to set used buf addr");
@@ -276,6 +661,16 @@ bool IXGBE_TxRingBuffer::cleanDescriptorRing(uint16_t min_clean_num){
 	if (cleanup_to >= m_num_desc) {
 		cleanup_to -= m_num_desc;
 	}
+	// DD is only written back to the last descriptor of a packet (RS), so the batch is extended to the end of the
+	// packet it stops in. those slots are the only ones tracking a pkt_buf
+	uint16_t num_clean = min_clean_num;
+	while (!a_linked_buf_addr[cleanup_to]) {
+		if (num_clean == cleanable) {
+			return false;
+		}
+		cleanup_to = wrap_ring(cleanup_to, m_num_desc);
+		num_clean++;
+	}
 	volatile union ixgbe_adv_tx_desc* txd = p_desc_ring_start + cleanup_to;
 	uint32_t status = txd->wb.status;
 	// only clean if the last descriptor in the batch is done
@@ -283,14 +678,17 @@ bool IXGBE_TxRingBuffer::cleanDescriptorRing(uint16_t min_clean_num){
 		return false;
 	}
 
-	// Clean exactly min_clean_num descriptors and their corresponding buffers
-	for (uint16_t cleaned = 0; cleaned < min_clean_num; cleaned++) {
-		struct pkt_buf* buf = a_linked_buf_addr[m_desc_head];
-		if (buf) {
-			p_mem_pool->freePktBuf(buf);
-		}
-		a_linked_buf_addr[m_desc_head] = nullptr;
-		m_desc_head = wrap_ring(m_desc_head, m_num_desc);
+	// Clean the descriptors of whole packets, their buffers are released straight from the shadow array,
+	// in two batches if the range wraps around the end of the ring. a cloned pkt_buf from another queue (mirroring)
+	// goes back to its own pool once its last reference is gone
+	uint16_t cleaned = 0;
+	while (cleaned < num_clean) {
+		uint16_t num = std::min<uint16_t>(num_clean - cleaned, m_num_desc - m_desc_head);
+		DMAMemoryPool::releaseMultiPktBuf(a_linked_buf_addr + m_desc_head, num);
+		// the slots no longer own their pkt_bufs, a stale pointer would be released twice
+		std::fill(a_linked_buf_addr + m_desc_head, a_linked_buf_addr + m_desc_head + num, nullptr);
+		m_desc_head = (uint16_t) ((m_desc_head + num) & (m_num_desc - 1));
+		cleaned += num;
 	}
 	return true;
 }
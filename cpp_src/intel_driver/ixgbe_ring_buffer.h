@@ -2,28 +2,129 @@
 #include "../common/memory_pool.h"
 #include "../common/basic_ring_buffer.h"
 #include "ixgbe_type.h"
+#include <mutex>
+
+// descriptors the vector rx path checks at once: 8 with AVX2, 4 with SSE2, no vector path elsewhere
+#if defined(__AVX2__)
+#define RX_VEC_BURST 8
+#elif defined(__SSE2__)
+#define RX_VEC_BURST 4
+#endif
+#define RX_FREE_THRESH 32 // default number of consumed rx descriptors that triggers a refill
+
+// TIMINCA of the 82599 per link speed as in the linux driver: SYSTIM advances incval every 6.4ns (10G) clock,
+// so that SYSTIM >> shift is in ns
+#define TIMINCA_INCPER (1u << 24)
+#define TIMINCA_INCVAL_10G (0x66666666u >> 7)
+#define TIMINCA_INCVAL_1G (0x40000000u >> 7)
+#define TIMINCA_INCVAL_100M (0x50000000u >> 7)
+#define SYSTIM_SHIFT_10G 21
+#define SYSTIM_SHIFT_1G 17
+#define SYSTIM_SHIFT_100M 14
+
+// turns the 64 bit SYSTIM of the nic into ns since the epoch. SYSTIM wraps after 2^(64 - shift) ns (2.4h at 10G),
+// a wrap between two reads is recovered from the monotonic clock. one instance per rx ring, not thread-safe,
+// only the rx stamp latch they share is locked
+class IXGBE_TimeCounter {
+    public:
+        // anchors SYSTIM, running with the TIMINCA of shift, to the wall clock. the nic has a single RXSTMPL/H latch,
+        // rx_stamp_lock is the lock of the device that every ring's copy takes to read it
+        void            init                (uint8_t* BAR_addr, uint32_t shift, std::mutex* rx_stamp_lock);
+        bool            isEnabled           () const { return p_bar_addr != nullptr; }
+        // SYSTIML latches SYSTIMH, so the low half has to be read first
+        uint64_t        readCycles          () const;
+        // cycles read from SYSTIM now, moves the counter forward
+        uint64_t        updateNs            (uint64_t cycles);
+        // cycles within half a wrap of the last update, e.g. a latched rx/tx stamp
+        uint64_t        toNs                (uint64_t cycles) const;
+        // rx stamp latched by the nic, reading RXSTMPH frees the latch for the next packet. false if none is latched
+        bool            readRxStamp         (uint64_t* p_cycles) const;
+    private:
+        uint8_t*        p_bar_addr{nullptr};
+        std::mutex*     p_rx_stamp_lock{nullptr};
+        uint32_t        m_shift{SYSTIM_SHIFT_10G};
+        uint64_t        m_cycle_last{0};
+        uint64_t        m_ns_last{0};
+        // cycles below one ns left over by the last update
+        uint64_t        m_frac{0};
+        uint64_t        m_mono_last{0};
+};
+
+// counters of one rx ring, doorbells per packet is what the refill threshold trades against latency
+struct RxRingStats {
+    uint64_t    rx_pkts{0};     // packets returned by readDescriptors
+    uint64_t    rx_bytes{0};    // their pkt_len, CRC stripped
+    uint64_t    refilled{0};    // descriptors handed back to the nic
+    uint64_t    doorbells{0};   // RDT writes
+    uint64_t    alloc_failed{0};        // refills cut short by an empty pool, retried by the next refill
+};
 
 
 
 class IXGBE_RxRingBuffer:public RingBuffer {
     public:
                         IXGBE_RxRingBuffer (){};
-                        ~IXGBE_RxRingBuffer(){};
+                        ~IXGBE_RxRingBuffer(){ delete[] a_hdr_buf_addr; };
         bool            linkMemoryPool           ( DMAMemoryPool* const mem_pool) override;
+        // header split: the nic writes the L2-L4 headers into pkt_bufs of this pool (one per descriptor, data room
+        // of at most 1KB in 64 byte units) and the payload into the packet pool. a split frame comes as a chain
+        // whose first segment holds the headers (PKT_RX_HDR_SPLIT). call it before createDescriptorRing
+        bool            linkHeaderPool      (DMAMemoryPool* const hdr_pool);
+        DMAMemoryPool*  getHeaderPool       () const { return p_hdr_pool; }
         uint16_t        fillDescRing        (uint16_t batch_size);
+        // refills all consumed descriptors with one bulk allocation and one RDT write, but only once at least
+        // rx_free_thresh of them are consumed. returns the number of descriptors refilled
+        uint16_t        refillDescRing      ();
+        bool            setRxFreeThresh     (uint16_t rx_free_thresh);
+        uint16_t        getRxFreeThresh     () const { return m_rx_free_thresh; }
+        const RxRingStats& getStats         () const { return m_stats; }
+        // whether the nic strips VLAN tags on this queue (RXDCTL.VME), reported with the packets
+        void            setVlanStrip        (bool enable) { m_vlan_strip = enable; }
+        // stamps every packet with the nic clock (PKT_RX_TIMESTAMP), the batch's reading (PKT_RX_TIMESTAMP_BATCH) unless
+        // the nic latched the packet's own stamp. an uninitialized counter turns it off
+        void            setTimeCounter      (const IXGBE_TimeCounter& time_counter) { m_time_counter = time_counter; }
+        // returns up to batch_size packets, a frame spread over several descriptors comes as a chain of pkt_bufs.
+        // a frame whose last descriptor is not written back yet is kept and completed in a later call
         uint16_t        readDescriptors(uint16_t batch_size, struct pkt_buf** bufs);
-        void            releasePktBufs(struct pkt_buf** bufs, uint16_t num_bufs){
-                                                                                    for (uint16_t i = 0; i < num_bufs; i++) {
-                                                                                        if (bufs[i])
-                                                                                            p_mem_pool->freePktBuf(bufs[i]);
-                                                                                    }
+        // whether the nic has written back the descriptor at the head, i.e. a read finds at least one segment
+        bool            isHeadDone     () const;
+        // readDescriptors takes the vector path where it can, off leaves every descriptor to the scalar loop
+        void            setVectorRx    (bool enable) { m_vector_rx = enable; }
+        // runs the ring on descriptors and pkt_bufs in plain memory, e.g. to test the rx paths without a device.
+        // bufs[i] is linked to desc_ring[i], everything from head on up to the descriptor before it belongs to the nic
+        void            attachMemory   (union ixgbe_adv_rx_desc* desc_ring, struct pkt_buf* const* bufs, uint32_t num_desc,
+                                        uint16_t head);
+        // drops the reference of a whole batch returned by readDescriptors, cloned pkt_bufs stay with their other owners
+        void            releasePktBufs(struct pkt_buf** bufs, uint16_t num_bufs POOL_SANITIZER_CALLER_DECL){
+                                                                                    DMAMemoryPool::releaseMultiPktBuf(bufs, num_bufs POOL_SANITIZER_CALLER);
                                                                                 }
         int             vfio_epoll_wait(int epoll_fd, uint16_t timeout);
         DMAMemoryPool*  getMemPool   () const { return p_mem_pool; } 
     private:
         bool            _bindDescMemIOVA          (uint8_t* BAR_addr, uint8_t index) override;
         bool            _bindDescMemVirt          () override    ;
-        volatile union ixgbe_adv_rx_desc*               p_desc_ring_start;
+        // one descriptor at a time, assembles chains of multi-segment frames
+        uint16_t        _readDescriptorsScalar    (uint16_t batch_size, struct pkt_buf** bufs);
+        // nic clock once per batch, the latched stamp for the packet flagged PKT_RX_IEEE1588_TMST
+        void            _setTimestamps            (uint16_t num_bufs, struct pkt_buf** bufs);
+#ifdef RX_VEC_BURST
+        // RX_VEC_BURST descriptors per step, stops at the first one that is not done or not a complete frame
+        uint16_t        _readDescriptorsVec       (uint16_t batch_size, struct pkt_buf** bufs);
+#endif
+        volatile union ixgbe_adv_rx_desc*               p_desc_ring_start{nullptr};
+        // first and last segment of a frame received only partially so far
+        struct pkt_buf*                                 p_rx_chain_head{nullptr};
+        struct pkt_buf*                                 p_rx_chain_tail{nullptr};
+        // header pool and the header pkt_buf linked to every descriptor, a slot keeps its buffer until the nic uses it
+        DMAMemoryPool*                                  p_hdr_pool{nullptr};
+        struct pkt_buf**                                a_hdr_buf_addr{nullptr};
+        // RDT of the queue in the BAR, the doorbell of refillDescRing
+        volatile uint32_t*                              p_tail_reg{nullptr};
+        uint16_t                                        m_rx_free_thresh{RX_FREE_THRESH};
+        RxRingStats                                     m_stats;
+        bool                                            m_vlan_strip{false};
+        bool                                            m_vector_rx{true};
+        IXGBE_TimeCounter                               m_time_counter;
 };
 
 
@@ -32,6 +133,7 @@ class IXGBE_TxRingBuffer:public RingBuffer {
                         IXGBE_TxRingBuffer      ();
                         ~IXGBE_TxRingBuffer     ();
         bool            linkMemoryPool         ( DMAMemoryPool* const mem_pool) override;
+        // one data descriptor per segment, a chained packet is dropped if the ring has no room for all of them
         uint16_t        linkPktWithDesc     (uint16_t batch_size);
         bool            fillPktBuf              (const char* data, uint32_t size);
         bool            cleanDescriptorRing     (uint16_t min_clean_num);
@@ -4,7 +4,7 @@
 #include <string>
 
 
-#define PKT_BUF_SIZE 2048
+#define PKT_BUF_SIZE (2048 + 128) // 2KB data room behind the pkt_buf header and headroom, one standard frame per descriptor
 #define PKT_SIZE 60
 
 const uint64_t INTERRUPT_INITIAL_INTERVAL = 1000 * 1000 * 1000;
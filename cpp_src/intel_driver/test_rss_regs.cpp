@@ -0,0 +1,67 @@
+// checks the RSS register layout written by Intel82599Dev::writeRSSRegs against a fake BAR in memory,
+// no device needed
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include "vfio_dev.h"
+#include "device.h"
+
+static int failures = 0;
+
+static void expect_reg(const uint8_t* bar, int reg, uint32_t expected, const char* name, uint32_t index){
+	uint32_t value = get_bar_reg32(bar, reg);
+	if (value != expected) {
+		printf("FAIL %s(%u): 0x%08X, expected 0x%08X\n", name, index, value, expected);
+		failures++;
+	}
+}
+
+int main(){
+	// the 82599 BAR0 is 128KB, every register used here lies in it
+	std::vector<uint8_t> fake_bar(0x20000, 0);
+	uint8_t* bar = fake_bar.data();
+	// the key of the Microsoft RSS verification suite
+	const uint8_t key[RSS_KEY_SIZE] = {
+		0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+		0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+		0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+	};
+	uint8_t reta[RSS_RETA_SIZE];
+	for (uint32_t i = 0; i < RSS_RETA_SIZE; i++) {
+		reta[i] = (uint8_t) ((i * 7) % RSS_MAX_QUEUES);
+	}
+	// bits of RXCSUM besides PCSD have to survive
+	set_bar_reg32(bar, IXGBE_RXCSUM, IXGBE_RXCSUM_IPPCSE);
+	Intel82599Dev::writeRSSRegs(bar, RSS_FIELDS_DEFAULT, key, reta);
+
+	// byte 0 of key and table in the low bits of the first register
+	expect_reg(bar, IXGBE_RSSRK(0), 0xda565a6d, "RSSRK", 0);
+	expect_reg(bar, IXGBE_RSSRK(9), 0xfa01acbe, "RSSRK", 9);
+	for (uint32_t i = 0; i < RSS_KEY_SIZE / 4; i++) {
+		uint32_t expected;
+		memcpy(&expected, key + 4 * i, sizeof(expected));
+		expect_reg(bar, IXGBE_RSSRK(i), expected, "RSSRK", i);
+	}
+	for (uint32_t i = 0; i < RSS_RETA_SIZE / 4; i++) {
+		uint32_t expected = reta[4 * i] | reta[4 * i + 1] << 8 | reta[4 * i + 2] << 16 | (uint32_t) reta[4 * i + 3] << 24;
+		expect_reg(bar, IXGBE_RETA(i), expected, "RETA", i);
+	}
+	expect_reg(bar, IXGBE_MRQC, IXGBE_MRQC_RSSEN | RSS_FIELDS_DEFAULT, "MRQC", 0);
+	expect_reg(bar, IXGBE_RXCSUM, IXGBE_RXCSUM_IPPCSE | IXGBE_RXCSUM_PCSD, "RXCSUM", 0);
+
+	// published hashes of the verification suite: 66.9.149.187:2794 -> 161.142.100.80:1766
+	const uint8_t input[12] = {66, 9, 149, 187, 161, 142, 100, 80, 0x0a, 0xea, 0x06, 0xe6};
+	uint32_t hash_ip = Intel82599Dev::toeplitzHash(key, input, 8);
+	uint32_t hash_tcp = Intel82599Dev::toeplitzHash(key, input, 12);
+	if (hash_ip != 0x323e8fc2 || hash_tcp != 0x51ccc178) {
+		printf("FAIL toeplitzHash: 0x%08X/0x%08X, expected 0x323e8fc2/0x51ccc178\n", hash_ip, hash_tcp);
+		failures++;
+	}
+
+	if (failures) {
+		printf("%d RSS checks failed\n", failures);
+		return 1;
+	}
+	printf("RSS registers OK\n");
+	return 0;
+}
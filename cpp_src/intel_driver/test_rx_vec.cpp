@@ -0,0 +1,176 @@
+// feeds the same synthetic write-back pattern of a descriptor ring in plain memory through readDescriptors with
+// the vector path on and off, both have to return the same pkt_bufs with the same lengths, chains and offload
+// results. covers the wrap at the end of the ring, runs cut short by a descriptor without DD and multi-segment frames
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "ixgbe_ring_buffer.h"
+
+#define NUM_OF_DESC 64
+#define BATCH_SIZE 32
+
+// what readDescriptors reports about one frame, segment by segment
+struct RxResult {
+	struct pkt_buf* buf;
+	uint32_t pkt_len;
+	uint16_t nb_segs;
+	uint32_t ol_flags;
+	uint16_t packet_type;
+	uint16_t vlan_tci;
+	uint32_t rss_hash;
+	std::vector<std::pair<struct pkt_buf*, uint16_t>> segs;
+};
+
+static int failures = 0;
+
+// xorshift, the same pattern for every run
+static uint32_t next_rand(uint32_t* p_state){
+	uint32_t x = *p_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*p_state = x;
+	return x;
+}
+
+// a write-back pattern, every descriptor done unless listed in not_done, a frame continues over the descriptors
+// listed in no_eop
+static void writeBack(union ixgbe_adv_rx_desc* descs, uint32_t seed, const std::vector<uint32_t>& not_done,
+                      const std::vector<uint32_t>& no_eop){
+	uint32_t state = seed;
+	for (uint32_t i = 0; i < NUM_OF_DESC; i++) {
+		uint32_t r = next_rand(&state);
+		uint32_t status = IXGBE_RXDADV_STAT_DD | IXGBE_RXDADV_STAT_EOP;
+		// offload results: checksums with and without errors, VLAN, flow director, timestamp
+		if (r & 0x1) status |= IXGBE_RXD_STAT_IPCS;
+		if (r & 0x2) status |= IXGBE_RXD_STAT_L4CS;
+		if (r & 0x4) status |= IXGBE_RXDADV_ERR_IPE;
+		if (r & 0x8) status |= IXGBE_RXDADV_ERR_TCPE;
+		if (r & 0x10) status |= IXGBE_RXDADV_STAT_VP;
+		if ((r & 0xE0) == 0xE0) status |= IXGBE_RXDADV_STAT_FLM;
+		for (uint32_t idx : not_done) {
+			if (idx == i) status &= ~IXGBE_RXDADV_STAT_DD;
+		}
+		for (uint32_t idx : no_eop) {
+			if (idx == i) status &= ~IXGBE_RXDADV_STAT_EOP;
+		}
+		descs[i].wb.lower.lo_dword.data = next_rand(&state) & 0x0FFF;
+		descs[i].wb.lower.hi_dword.rss = next_rand(&state);
+		descs[i].wb.upper.status_error = status;
+		descs[i].wb.upper.length = (uint16_t) (60 + next_rand(&state) % 1455);
+		descs[i].wb.upper.vlan = (uint16_t) next_rand(&state);
+	}
+}
+
+// reads until the ring has nothing left, with fresh pkt_buf headers
+static std::vector<RxResult> readAll(IXGBE_RxRingBuffer* ring, std::vector<struct pkt_buf*>& bufs, uint8_t* buf_mem,
+                                     size_t buf_mem_size, union ixgbe_adv_rx_desc* descs, uint16_t head, bool vector_rx,
+                                     std::vector<uint32_t>* p_not_done){
+	memset(buf_mem, 0, buf_mem_size);
+	ring->attachMemory(descs, bufs.data(), NUM_OF_DESC, head);
+	ring->setVectorRx(vector_rx);
+	std::vector<RxResult> results;
+	struct pkt_buf* rx_bufs[BATCH_SIZE];
+	for (int pass = 0; pass < 2; pass++) {
+		uint16_t num;
+		while ((num = ring->readDescriptors(BATCH_SIZE, rx_bufs)) != 0) {
+			for (uint16_t i = 0; i < num; i++) {
+				struct pkt_buf* buf = rx_bufs[i];
+				RxResult result = {buf, buf->pkt_len, buf->nb_segs, buf->ol_flags, buf->packet_type, buf->vlan_tci,
+				                   buf->rss_hash, {}};
+				for (struct pkt_buf* seg = buf; seg; seg = seg->next) {
+					result.segs.push_back({seg, seg->size});
+				}
+				results.push_back(result);
+			}
+		}
+		// the nic writes back the descriptors that were not done yet, the reads continue where they stopped
+		for (uint32_t idx : *p_not_done) {
+			descs[idx].wb.upper.status_error |= IXGBE_RXDADV_STAT_DD;
+		}
+	}
+	for (uint32_t idx : *p_not_done) {
+		descs[idx].wb.upper.status_error &= ~IXGBE_RXDADV_STAT_DD;
+	}
+	return results;
+}
+
+static void compare(const char* name, const std::vector<RxResult>& vec, const std::vector<RxResult>& scalar,
+                    size_t expected_frames){
+	if (vec.size() != scalar.size() || vec.size() != expected_frames) {
+		printf("FAIL %s: %zu frames with the vector path, %zu without, expected %zu\n", name, vec.size(), scalar.size(),
+		       expected_frames);
+		failures++;
+		return;
+	}
+	for (size_t i = 0; i < vec.size(); i++) {
+		const RxResult& a = vec[i];
+		const RxResult& b = scalar[i];
+		if (a.buf != b.buf || a.pkt_len != b.pkt_len || a.nb_segs != b.nb_segs || a.ol_flags != b.ol_flags ||
+		    a.packet_type != b.packet_type || a.vlan_tci != b.vlan_tci || a.rss_hash != b.rss_hash || a.segs != b.segs) {
+			printf("FAIL %s: frame %zu differs: buf %p/%p len %u/%u segs %u/%u flags 0x%x/0x%x type 0x%x/0x%x "
+			       "vlan 0x%x/0x%x hash 0x%x/0x%x\n", name, i, (void*) a.buf, (void*) b.buf, a.pkt_len, b.pkt_len,
+			       a.nb_segs, b.nb_segs, a.ol_flags, b.ol_flags, a.packet_type, b.packet_type, a.vlan_tci, b.vlan_tci,
+			       a.rss_hash, b.rss_hash);
+			failures++;
+			return;
+		}
+	}
+}
+
+int main(){
+	const uint32_t buf_size = 256;
+	size_t buf_mem_size = (size_t) NUM_OF_DESC * buf_size;
+	uint8_t* buf_mem = (uint8_t*) aligned_alloc(64, buf_mem_size);
+	union ixgbe_adv_rx_desc* descs = (union ixgbe_adv_rx_desc*) aligned_alloc(128, NUM_OF_DESC * sizeof(union ixgbe_adv_rx_desc));
+	std::vector<struct pkt_buf*> bufs(NUM_OF_DESC);
+	for (uint32_t i = 0; i < NUM_OF_DESC; i++) {
+		bufs[i] = (struct pkt_buf*) (buf_mem + (size_t) i * buf_size);
+	}
+	IXGBE_RxRingBuffer ring;
+	ring.setVlanStrip(true);
+
+	struct Scenario {
+		const char* name;
+		uint16_t head;
+		std::vector<uint32_t> not_done;
+		std::vector<uint32_t> no_eop;
+		// frames of the NUM_OF_DESC - 1 descriptors owned by the nic
+		size_t frames;
+	};
+	const std::vector<Scenario> scenarios = {
+		{"all done", 0, {}, {}, NUM_OF_DESC - 1},
+		{"wrap", NUM_OF_DESC - 5, {}, {}, NUM_OF_DESC - 1},
+		{"wrap unaligned", NUM_OF_DESC - 11, {}, {}, NUM_OF_DESC - 1},
+		// a descriptor without DD stops both paths, later descriptors that are done must not be taken yet
+		{"DD gap", 0, {3}, {}, NUM_OF_DESC - 1},
+		{"DD gaps", 5, {9, 16, 17, 40}, {}, NUM_OF_DESC - 1},
+		{"DD gap at wrap", NUM_OF_DESC - 6, {NUM_OF_DESC - 2, 1}, {}, NUM_OF_DESC - 1},
+		// multi-segment frames inside a burst, across a burst and across the wrap
+		{"chains", 0, {}, {2, 7, 8, 9, 20}, NUM_OF_DESC - 1 - 5},
+		{"chain at wrap", NUM_OF_DESC - 4, {}, {NUM_OF_DESC - 1, 0}, NUM_OF_DESC - 1 - 2},
+		// a frame whose next segment is not written back yet
+		{"chain with DD gap", 0, {6}, {5}, NUM_OF_DESC - 1 - 1},
+	};
+	uint32_t seed = 0x12345678;
+	for (const Scenario& scenario : scenarios) {
+		writeBack(descs, seed++, scenario.not_done, scenario.no_eop);
+		std::vector<uint32_t> not_done = scenario.not_done;
+		std::vector<RxResult> vec = readAll(&ring, bufs, buf_mem, buf_mem_size, descs, scenario.head, true, &not_done);
+		std::vector<RxResult> scalar = readAll(&ring, bufs, buf_mem, buf_mem_size, descs, scenario.head, false, &not_done);
+		compare(scenario.name, vec, scalar, scenario.frames);
+	}
+	free(descs);
+	free(buf_mem);
+	if (failures) {
+		printf("%d rx path checks failed\n", failures);
+		return 1;
+	}
+#ifdef RX_VEC_BURST
+	printf("vector (%u descriptors per step) and scalar rx paths agree\n", RX_VEC_BURST);
+#else
+	printf("no vector rx path on this target, scalar path checked only\n");
+#endif
+	return 0;
+}
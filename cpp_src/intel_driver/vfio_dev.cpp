@@ -13,6 +13,8 @@
 #include "ixgbe_ring_buffer.h"
 #include <string>
 #include <sys/time.h>
+#include <netinet/in.h>
+#include <algorithm>
 
 static char pkt_data[PKT_SIZE] = {
 	0x01, 0x02, 0x03, 0x04, 0x05, 0x06, // dst MAC
@@ -45,23 +47,33 @@ typedef struct pcap_hdr_s {
 
 typedef struct pcaprec_hdr_s {
 	uint32_t ts_sec;        /* timestamp seconds */
-	uint32_t ts_usec;       /* timestamp microseconds */
+	uint32_t ts_usec;       /* timestamp microseconds, nanoseconds with the magic 0xa1b23c4d */
 	uint32_t incl_len;      /* number of octets of packet saved in file */
 	uint32_t orig_len;      /* actual length of packet */
 } __attribute__((packed)) pcaprec_hdr_t;
 
-Intel82599Dev::Intel82599Dev(std::string pci_addr, uint8_t max_bar_index) :
+// the key of the Microsoft RSS verification suite, hashes of it can be checked against published values
+static const uint8_t rss_default_key[RSS_KEY_SIZE] = {
+	0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2, 0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+	0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4, 0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+	0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+Intel82599Dev::Intel82599Dev(std::string pci_addr, uint8_t max_bar_index, int container_fd) :
 // get file descriptors of the 1. container, 2. group, 3. device
 // get the BAR address
 // enable DMA in terms of the NIC hardware register.
-BasicDev(pci_addr,max_bar_index)
+BasicDev(pci_addr,max_bar_index,container_fd)
 {
 	 		_getFD()     				&&
 			_getBARAddr (max_bar_index) &&
 			_enableDMA()                ;
+	std::copy(rss_default_key, rss_default_key + RSS_KEY_SIZE, m_rss_key.begin());
 }
 
 Intel82599Dev::~Intel82599Dev(){
+	_releaseRxRingBuffers();
+	_releaseTxRingBuffers();
 };
 
 // _getFD(), _getBARAddr(), and related VFIO helper functions are now inherited from BasicDev
@@ -112,6 +124,10 @@ bool Intel82599Dev::initHardware() {
 
 bool Intel82599Dev::enableDevQueues() {
     debug("entered Intel82599Dev::enableDevQueues");
+	if (m_warm_start) {
+		this->_warmDMAMemory();
+	}
+	this->_initRSS();
 	this->_enableDevRxQueue();
 	this->_enableDevTxQueue();
     return true;
@@ -120,31 +136,209 @@ bool Intel82599Dev::enableDevQueues() {
 
 bool Intel82599Dev::setRxRingBuffers(uint16_t num_rx_queues,uint32_t num_buf, uint32_t buf_size){
 	info("settingRxRingBuffers");
+	// resizing: the old rings and pools go back to the allocator before the new ones are mapped
+	_releaseRxRingBuffers();
     m_basic_para.num_rx_queues = num_rx_queues;
     m_num_rx_bufs = num_buf;
     m_buf_rx_size = buf_size;
+	// the headers the nic splits off, PSRTYPE(0) is the one of all queues without VMDq
+	const uint32_t split_hdrs = IXGBE_PSRTYPE_L2HDR | IXGBE_PSRTYPE_IPV4HDR | IXGBE_PSRTYPE_IPV6HDR |
+	                            IXGBE_PSRTYPE_TCPHDR | IXGBE_PSRTYPE_UDPHDR;
+	if (m_hdr_split_size) {
+		set_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_PSRTYPE(0), split_hdrs);
+	} else {
+		clear_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_PSRTYPE(0), split_hdrs);
+	}
+	// a small ring gets a lower threshold, otherwise its consumed descriptors would never reach it
+	uint16_t rx_free_thresh = (uint16_t) std::min<uint32_t>(m_rx_free_thresh, std::max<uint32_t>(num_buf / 2, 1));
+	if (rx_free_thresh != m_rx_free_thresh) {
+		warn("rx_free_thresh %u does not fit a ring of %u descriptors, using %u", m_rx_free_thresh, num_buf, rx_free_thresh);
+	}
     for (uint16_t i = 0; i < m_basic_para.num_rx_queues; i++) {
 		// p_mempool.push_back(new DMAMemoryPool(num_buf, buf_size, m_fds.container_fd));
         p_rx_ring_buffers.push_back(new IXGBE_RxRingBuffer);
-        p_rx_ring_buffers[i]->linkMemoryPool(new DMAMemoryPool(num_buf, buf_size, m_fds.container_fd));
-		p_rx_ring_buffers[i]->createDescriptorRing(m_fds.container_fd,m_basic_para.p_bar_addr[0],num_buf,sizeof(union ixgbe_adv_rx_desc),i);
+        p_rx_ring_buffers[i]->linkMemoryPool(new DMAMemoryPool(_getPoolSize(num_buf), buf_size, m_fds.container_fd, m_basic_para.numa_node,
+		                                                       "rxq" + std::to_string(i) + " pool", m_pkt_buf_headroom));
+		p_rx_ring_buffers[i]->setPortId(m_port_id);
+		p_rx_ring_buffers[i]->getMemPool()->setThreadSafe(m_thread_safe_pools, m_pool_cache_size);
+		if (m_hdr_split_size) {
+			// no headroom, the headers of consecutive buffers are only the pkt_buf header apart
+			p_rx_ring_buffers[i]->linkHeaderPool(new DMAMemoryPool(_getPoolSize(num_buf), sizeof(struct pkt_buf) + m_hdr_split_size,
+			                                                       m_fds.container_fd, m_basic_para.numa_node,
+			                                                       "rxq" + std::to_string(i) + " hdr pool", 0));
+			p_rx_ring_buffers[i]->getHeaderPool()->setThreadSafe(m_thread_safe_pools, m_pool_cache_size);
+		}
+		p_rx_ring_buffers[i]->createDescriptorRing(m_fds.container_fd,m_basic_para.p_bar_addr[0],num_buf,sizeof(union ixgbe_adv_rx_desc),i,m_basic_para.numa_node,
+		                                           "rxq" + std::to_string(i) + " ring");
+		if (!p_rx_ring_buffers[i]->setRxFreeThresh(rx_free_thresh)) {
+			return false;
+		}
+		p_rx_ring_buffers[i]->setVlanStrip(m_vlan_strip);
+		p_rx_ring_buffers[i]->setTimeCounter(m_time_counter);
 		p_rx_ring_buffers[i]->fillDescRing(num_buf);
     }
     return true;
 }
 
 bool Intel82599Dev::setTxRingBuffers(uint16_t num_tx_queues,uint32_t num_buf, uint32_t buf_size){
+	_releaseTxRingBuffers();
     m_basic_para.num_tx_queues = num_tx_queues;
     m_num_tx_bufs = num_buf;
     m_buf_tx_size = buf_size;
     for (uint16_t i = 0; i < m_basic_para.num_tx_queues; i++) {
         p_tx_ring_buffers.push_back(new IXGBE_TxRingBuffer);
-		p_tx_ring_buffers[i]->linkMemoryPool(new DMAMemoryPool(num_buf, buf_size, m_fds.container_fd));
-		p_tx_ring_buffers[i]->createDescriptorRing(m_fds.container_fd,m_basic_para.p_bar_addr[0],num_buf,sizeof(union ixgbe_adv_tx_desc),i);
+		p_tx_ring_buffers[i]->linkMemoryPool(new DMAMemoryPool(_getPoolSize(num_buf), buf_size, m_fds.container_fd, m_basic_para.numa_node,
+		                                                       "txq" + std::to_string(i) + " pool", m_pkt_buf_headroom));
+		p_tx_ring_buffers[i]->getMemPool()->setThreadSafe(m_thread_safe_pools, m_pool_cache_size);
+		p_tx_ring_buffers[i]->createDescriptorRing(m_fds.container_fd,m_basic_para.p_bar_addr[0],num_buf,sizeof(union ixgbe_adv_tx_desc),i,m_basic_para.numa_node,
+		                                           "txq" + std::to_string(i) + " ring");
     }
     return true;
 }
 
+void Intel82599Dev::setWarmStart(bool enable, bool pre_zero){
+	m_warm_start = enable;
+	m_warm_pre_zero = pre_zero;
+	DMAMemoryAllocator::getInstance(m_fds.container_fd).setWarmStart(enable);
+	if (enable && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+		warn("mlockall failed, raise RLIMIT_MEMLOCK: %s", strerror(errno));
+	}
+}
+
+// pkt_bufs of a queue's pool: one per descriptor, plus what the caches of the threads sharing it may hold in
+// thread-safe mode, otherwise cached pkt_bufs would be missing when the ring is refilled
+uint32_t Intel82599Dev::_getPoolSize(uint32_t num_desc) const{
+	if (!m_thread_safe_pools) {
+		return num_desc;
+	}
+	return num_desc + m_pool_threads * m_pool_cache_size;
+}
+
+void Intel82599Dev::setThreadSafePools(bool enable, uint32_t num_threads, uint32_t cache_size){
+	if (num_threads > MAX_POOL_THREADS) {
+		warn("%u threads per pool, only %u get a cache", num_threads, MAX_POOL_THREADS);
+		num_threads = MAX_POOL_THREADS;
+	}
+	m_thread_safe_pools = enable;
+	m_pool_threads = num_threads;
+	m_pool_cache_size = cache_size;
+	if (enable && (!p_rx_ring_buffers.empty() || !p_tx_ring_buffers.empty())) {
+		warn("thread-safe pools enabled after the rings were set up, the pools have no room for the thread caches "
+		     "until setRxRingBuffers/setTxRingBuffers are called again");
+	}
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		rx_ring->getMemPool()->setThreadSafe(enable, cache_size);
+		if (rx_ring->getHeaderPool()) {
+			rx_ring->getHeaderPool()->setThreadSafe(enable, cache_size);
+		}
+	}
+	for (auto* tx_ring : p_tx_ring_buffers) {
+		tx_ring->getMemPool()->setThreadSafe(enable, cache_size);
+	}
+}
+
+void Intel82599Dev::setPortId(uint16_t port_id){
+	m_port_id = port_id;
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		rx_ring->setPortId(port_id);
+	}
+}
+
+bool Intel82599Dev::setRxFreeThresh(uint16_t rx_free_thresh){
+	m_rx_free_thresh = rx_free_thresh;
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		if (!rx_ring->setRxFreeThresh(rx_free_thresh)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Intel82599Dev::setHeaderSplit(uint16_t hdr_size){
+	if (hdr_size % 64 || hdr_size > 1024) {
+		warn("header buffer of %u bytes is not a multiple of 64 up to 1024", hdr_size);
+		return false;
+	}
+	m_hdr_split_size = hdr_size;
+	return true;
+}
+
+void Intel82599Dev::setVlanStrip(bool enable){
+	m_vlan_strip = enable;
+	for (uint16_t queue_id = 0; queue_id < p_rx_ring_buffers.size(); queue_id++) {
+		// VME may be changed while the queue is running
+		if (enable) {
+			set_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_VME);
+		} else {
+			clear_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_VME);
+		}
+		p_rx_ring_buffers[queue_id]->setVlanStrip(enable);
+	}
+}
+
+const RxRingStats* Intel82599Dev::getRxRingStats(uint16_t queue_id) const{
+	return queue_id < p_rx_ring_buffers.size() ? &p_rx_ring_buffers[queue_id]->getStats() : nullptr;
+}
+
+DMAMemoryPool* Intel82599Dev::getRxMemPool(uint16_t queue_id) const{
+	return queue_id < p_rx_ring_buffers.size() ? p_rx_ring_buffers[queue_id]->getMemPool() : nullptr;
+}
+
+DMAMemoryPool* Intel82599Dev::getTxMemPool(uint16_t queue_id) const{
+	return queue_id < p_tx_ring_buffers.size() ? p_tx_ring_buffers[queue_id]->getMemPool() : nullptr;
+}
+
+bool Intel82599Dev::setFileBacking(const std::string& dir){
+	return DMAMemoryAllocator::getInstance(m_fds.container_fd).setFileBacking(dir, m_basic_para.pci_addr);
+}
+
+// takes the first-touch page faults of all pools now instead of on the first packets
+void Intel82599Dev::_warmDMAMemory(){
+	uint64_t nanos = 0;
+	uint64_t bytes = 0;
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		nanos += rx_ring->getMemPool()->warmUp(m_warm_pre_zero);
+		bytes += (uint64_t) rx_ring->getMemPool()->getNumOfBufs() * rx_ring->getMemPool()->getBufSize();
+		if (DMAMemoryPool* hdr_pool = rx_ring->getHeaderPool()) {
+			nanos += hdr_pool->warmUp(m_warm_pre_zero);
+			bytes += (uint64_t) hdr_pool->getNumOfBufs() * hdr_pool->getBufSize();
+		}
+	}
+	for (auto* tx_ring : p_tx_ring_buffers) {
+		nanos += tx_ring->getMemPool()->warmUp(m_warm_pre_zero);
+		bytes += (uint64_t) tx_ring->getMemPool()->getNumOfBufs() * tx_ring->getMemPool()->getBufSize();
+	}
+	info("warm start: %llu bytes of DMA memory warmed in %.3f ms", (unsigned long long) bytes, nanos / 1e6);
+}
+
+// stops the rx queues and hands their descriptor rings and pkt_buf pools back to the DMA allocator
+bool Intel82599Dev::_releaseRxRingBuffers(){
+	for (uint16_t queue_id = 0; queue_id < p_rx_ring_buffers.size(); queue_id++) {
+		// the NIC must not write into memory which is about to be unmapped
+		clear_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_ENABLE);
+		wait_clear_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_ENABLE);
+		DMAMemoryPool* mem_pool = p_rx_ring_buffers[queue_id]->getMemPool();
+		DMAMemoryPool* hdr_pool = p_rx_ring_buffers[queue_id]->getHeaderPool();
+		delete p_rx_ring_buffers[queue_id];
+		delete mem_pool;
+		delete hdr_pool;
+	}
+	p_rx_ring_buffers.clear();
+	return true;
+}
+
+bool Intel82599Dev::_releaseTxRingBuffers(){
+	for (uint16_t queue_id = 0; queue_id < p_tx_ring_buffers.size(); queue_id++) {
+		clear_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_TXDCTL(queue_id), IXGBE_TXDCTL_ENABLE);
+		wait_clear_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_TXDCTL(queue_id), IXGBE_TXDCTL_ENABLE);
+		DMAMemoryPool* mem_pool = p_tx_ring_buffers[queue_id]->getMemPool();
+		delete p_tx_ring_buffers[queue_id];
+		delete mem_pool;
+	}
+	p_tx_ring_buffers.clear();
+	return true;
+}
+
 DevStatus Intel82599Dev::_readStatus(){
 	uint32_t rx_pkts = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_GPRC);
 	uint32_t tx_pkts = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_GPTC);
@@ -242,8 +436,9 @@ uint16_t Intel82599Dev::_calc_ip_checksum(uint8_t* data, uint32_t len) {
 
 bool Intel82599Dev::_enableDevRxQueue(){
 	for (uint16_t queue_id = 0; queue_id < m_basic_para.num_rx_queues; queue_id++){
-		// enable queue and wait if necessary
-		set_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_ENABLE);
+		// enable queue and wait if necessary, VLAN stripping is part of the same register
+		set_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id),
+		                m_vlan_strip ? IXGBE_RXDCTL_ENABLE | IXGBE_RXDCTL_VME : IXGBE_RXDCTL_ENABLE);
 		wait_set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_RXDCTL(queue_id), IXGBE_RXDCTL_ENABLE);
 		// rx queue starts out full
 		set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_RDH(queue_id), 0);
@@ -286,7 +481,7 @@ void Intel82599Dev::_enableDevMSIInterrupt(uint16_t queue_id){
 	// In our case we prefer not auto-masking the interrupts
 
 	// Step 5: Set the interrupt throttling in EITR[n] and GPIE according to the preferred mode of operation.
-	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EITR(queue_id), m_interrupt_para.itr_rate);
+	_writeQueueITR(queue_id, m_interrupt_para.dynamic_itr ? EITR_LOW_LATENCY : m_interrupt_para.itr_rate);
 
 	// Step 6: Software clears EICR by writing all ones to clear old interrupt causes
 	_dev_clear_interrupts();
@@ -335,12 +530,10 @@ void Intel82599Dev::_enableDevMSIxInterrupt(uint16_t queue_id){
 	// 0xE10 (900us) => 1080 INT/s
 	// 0xFA7 (1000us) => 980 INT/s
 	// 0xFFF (1024us) => 950 INT/s
-	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EITR(queue_id), m_interrupt_para.itr_rate);
+	_writeQueueITR(queue_id, m_interrupt_para.dynamic_itr ? EITR_LOW_LATENCY : m_interrupt_para.itr_rate);
 
 	// Step 6: Software enables the required interrupt causes by setting the EIMS register
-	u32 mask = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EIMS);
-	mask |= (1 << queue_id);
-	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EIMS, mask);
+	setQueueInterrupt(queue_id, false, true);
 	debug("Using MSIX interrupts");
 }
 
@@ -370,6 +563,13 @@ bool Intel82599Dev::enableDevInterrupt(){
 				return false;
 		}
 	}
+	// tx queues get their own vectors but stay masked, the tx rings are cleaned inline. a QueueEventLoop that
+	// waits on a tx queue unmasks it
+	for (uint16_t queue_id = 0; queue_id < m_tx_event_fds.size(); queue_id++) {
+		uint16_t vector = (uint16_t) (m_basic_para.num_rx_queues + queue_id);
+		set_ivar(m_basic_para.p_bar_addr[0], 1, queue_id, vector);
+		set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EITR(vector), m_interrupt_para.itr_rate);
+	}
     debug("finished enabling interrupts");
 	return true;
 }
@@ -386,6 +586,443 @@ bool Intel82599Dev::setPromisc(bool enable){
 }
 
 
+bool Intel82599Dev::enableTimestamping(uint32_t rx_filter){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	if (rx_filter & ~IXGBE_TSYNCRXCTL_TYPE_MASK) {
+		warn("invalid rx timestamp filter 0x%x", rx_filter);
+		return false;
+	}
+	uint32_t incval = TIMINCA_INCVAL_10G;
+	uint32_t shift = SYSTIM_SHIFT_10G;
+	switch (_get_link_speed()) {
+		case 100:
+			incval = TIMINCA_INCVAL_100M;
+			shift = SYSTIM_SHIFT_100M;
+			break;
+		case 1000:
+			incval = TIMINCA_INCVAL_1G;
+			shift = SYSTIM_SHIFT_1G;
+			break;
+		case 10000:
+			break;
+		default:
+			warn("link is down, timestamps assume 10 Gbit/s");
+	}
+	set_bar_reg32(bar, IXGBE_TIMINCA, TIMINCA_INCPER | incval);
+	// PTP over ethernet only reaches the L2 filters through an ethertype filter with the 1588 flag
+	set_bar_reg32(bar, IXGBE_ETQF(IXGBE_ETQF_FILTER_1588), PTP_ETHERTYPE | IXGBE_ETQF_FILTER_EN | IXGBE_ETQF_1588);
+	set_bar_reg32(bar, IXGBE_TSYNCRXCTL, (get_bar_reg32(bar, IXGBE_TSYNCRXCTL) & ~IXGBE_TSYNCRXCTL_TYPE_MASK) |
+	                                     rx_filter | IXGBE_TSYNCRXCTL_ENABLED);
+	set_bar_flags32(bar, IXGBE_TSYNCTXCTL, IXGBE_TSYNCTXCTL_ENABLED);
+	// stamps latched before are stale, reading the high halves frees the latches
+	{
+		std::lock_guard<std::mutex> guard(m_rx_stamp_lock);
+		get_bar_reg32(bar, IXGBE_RXSTMPH);
+	}
+	get_bar_reg32(bar, IXGBE_TXSTMPH);
+	m_time_counter.init(bar, shift, &m_rx_stamp_lock);
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		rx_ring->setTimeCounter(m_time_counter);
+	}
+	info("hardware timestamping enabled, TIMINCA 0x%08x", TIMINCA_INCPER | incval);
+	return true;
+}
+
+void Intel82599Dev::disableTimestamping(){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	clear_bar_flags32(bar, IXGBE_TSYNCRXCTL, IXGBE_TSYNCRXCTL_ENABLED);
+	clear_bar_flags32(bar, IXGBE_TSYNCTXCTL, IXGBE_TSYNCTXCTL_ENABLED);
+	set_bar_reg32(bar, IXGBE_ETQF(IXGBE_ETQF_FILTER_1588), 0);
+	m_time_counter = IXGBE_TimeCounter();
+	for (auto* rx_ring : p_rx_ring_buffers) {
+		rx_ring->setTimeCounter(m_time_counter);
+	}
+}
+
+uint64_t Intel82599Dev::getHwTime(){
+	if (!m_time_counter.isEnabled()) {
+		return 0;
+	}
+	return m_time_counter.updateNs(m_time_counter.readCycles());
+}
+
+bool Intel82599Dev::readTxTimestamp(uint64_t* p_ns){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	if (!m_time_counter.isEnabled() || !(get_bar_reg32(bar, IXGBE_TSYNCTXCTL) & IXGBE_TSYNCTXCTL_VALID)) {
+		return false;
+	}
+	uint64_t low = get_bar_reg32(bar, IXGBE_TXSTMPL);
+	uint64_t cycles = ((uint64_t) get_bar_reg32(bar, IXGBE_TXSTMPH) << 32) | low;
+	// keeps the counter close to the stamp, which is at most a few ms old
+	getHwTime();
+	*p_ns = m_time_counter.toNs(cycles);
+	return true;
+}
+
+bool Intel82599Dev::setMaxFrameSize(uint32_t max_frame_size){
+	// 82599 accepts jumbo frames up to 15.5KB
+	if (max_frame_size < 64 || max_frame_size > 15872) {
+		error("max frame size %u out of range [64, 15872]", max_frame_size);
+		return false;
+	}
+	info("setting max frame size to %u bytes", max_frame_size);
+	uint32_t mhadd = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_MAXFRS) & ~IXGBE_MHADD_MFS_MASK;
+	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_MAXFRS, mhadd | (max_frame_size << IXGBE_MHADD_MFS_SHIFT));
+	if (max_frame_size > 1518) {
+		set_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_HLREG0, IXGBE_HLREG0_JUMBOEN);
+	} else {
+		clear_bar_flags32(m_basic_para.p_bar_addr[0], IXGBE_HLREG0, IXGBE_HLREG0_JUMBOEN);
+	}
+	return true;
+}
+
+
+bool Intel82599Dev::setRSS(uint32_t rss_fields, const std::vector<uint8_t>& key){
+	if (rss_fields & ~IXGBE_MRQC_RSS_FIELD_MASK) {
+		warn("invalid RSS fields 0x%08X, use IXGBE_MRQC_RSS_FIELD_*", rss_fields);
+		return false;
+	}
+	if (!key.empty()) {
+		if (key.size() != RSS_KEY_SIZE) {
+			warn("RSS key has %zu bytes instead of %u", key.size(), RSS_KEY_SIZE);
+			return false;
+		}
+		std::copy(key.begin(), key.end(), m_rss_key.begin());
+	}
+	m_rss_fields = rss_fields;
+	// the rings exist, so do the registers the queues depend on
+	if (!p_rx_ring_buffers.empty()) {
+		return _initRSS();
+	}
+	return true;
+}
+
+bool Intel82599Dev::setRSSRedirection(const std::vector<uint8_t>& reta){
+	if (reta.size() != RSS_RETA_SIZE) {
+		warn("RSS redirection table has %zu entries instead of %u", reta.size(), RSS_RETA_SIZE);
+		return false;
+	}
+	std::copy(reta.begin(), reta.end(), m_rss_reta.begin());
+	m_rss_reta_custom = true;
+	if (!p_rx_ring_buffers.empty()) {
+		return _initRSS();
+	}
+	return true;
+}
+
+// programs key, redirection table and hash fields, RSS stays off with a single rx queue
+bool Intel82599Dev::_initRSS(){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	uint16_t num_queues = std::min<uint16_t>(m_basic_para.num_rx_queues, RSS_MAX_QUEUES);
+	if (num_queues <= 1 || !m_rss_fields) {
+		set_bar_reg32(bar, IXGBE_MRQC, 0);
+		return true;
+	}
+	if (m_basic_para.num_rx_queues > RSS_MAX_QUEUES) {
+		warn("RSS spreads over the first %u of %u rx queues", RSS_MAX_QUEUES, m_basic_para.num_rx_queues);
+	}
+	if (!m_rss_reta_custom) {
+		for (uint32_t i = 0; i < RSS_RETA_SIZE; i++) {
+			m_rss_reta[i] = (uint8_t) (i % num_queues);
+		}
+	}
+	for (uint32_t i = 0; i < RSS_RETA_SIZE; i++) {
+		if (m_rss_reta[i] >= num_queues) {
+			warn("RSS redirection entry %u points to rx queue %u of %u", i, m_rss_reta[i], num_queues);
+			return false;
+		}
+	}
+	writeRSSRegs(bar, m_rss_fields, m_rss_key.data(), m_rss_reta.data());
+	info("RSS over %u rx queues, hash fields 0x%08X", num_queues, m_rss_fields);
+	return true;
+}
+
+void Intel82599Dev::writeRSSRegs(uint8_t* bar, uint32_t rss_fields, const uint8_t* key, const uint8_t* reta){
+	// the key and the table are packed little endian, byte 0 in the low bits of the first register
+	for (uint32_t i = 0; i < RSS_KEY_SIZE / 4; i++) {
+		set_bar_reg32(bar, IXGBE_RSSRK(i), key[4 * i] | key[4 * i + 1] << 8 | key[4 * i + 2] << 16 |
+		                                   (uint32_t) key[4 * i + 3] << 24);
+	}
+	for (uint32_t i = 0; i < RSS_RETA_SIZE / 4; i++) {
+		set_bar_reg32(bar, IXGBE_RETA(i), reta[4 * i] | reta[4 * i + 1] << 8 | reta[4 * i + 2] << 16 |
+		                                  (uint32_t) reta[4 * i + 3] << 24);
+	}
+	// the rss hash is written back in place of the fragment checksum, see 8.2.3.7.5
+	set_bar_flags32(bar, IXGBE_RXCSUM, IXGBE_RXCSUM_PCSD);
+	set_bar_reg32(bar, IXGBE_MRQC, IXGBE_MRQC_RSSEN | rss_fields);
+}
+
+uint32_t Intel82599Dev::toeplitzHash(const uint8_t* key, const uint8_t* data, uint32_t len){
+	uint32_t hash = 0;
+	// the 32 key bits aligned with the current input bit
+	uint32_t window = (uint32_t) key[0] << 24 | key[1] << 16 | key[2] << 8 | key[3];
+	for (uint32_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			if (data[i] & (1 << bit)) {
+				hash ^= window;
+			}
+			window = window << 1 | ((key[i + 4] >> bit) & 1);
+		}
+	}
+	return hash;
+}
+
+// the input the nic hashes for the flow: addresses, then ports if the l4 field of the protocol is enabled
+bool Intel82599Dev::_getRSSInput(const RSSFlow& flow, uint8_t* p_input, uint32_t* p_len) const{
+	uint32_t addr_len = flow.ipv6 ? 16 : 4;
+	uint32_t l4_field;
+	uint32_t l3_field;
+	if (flow.ipv6) {
+		l3_field = IXGBE_MRQC_RSS_FIELD_IPV6;
+		l4_field = flow.l4_proto == IPPROTO_TCP ? IXGBE_MRQC_RSS_FIELD_IPV6_TCP :
+		           flow.l4_proto == IPPROTO_UDP ? IXGBE_MRQC_RSS_FIELD_IPV6_UDP : 0;
+	} else {
+		l3_field = IXGBE_MRQC_RSS_FIELD_IPV4;
+		l4_field = flow.l4_proto == IPPROTO_TCP ? IXGBE_MRQC_RSS_FIELD_IPV4_TCP :
+		           flow.l4_proto == IPPROTO_UDP ? IXGBE_MRQC_RSS_FIELD_IPV4_UDP : 0;
+	}
+	bool with_ports = m_rss_fields & l4_field;
+	if (!with_ports && !(m_rss_fields & l3_field)) {
+		return false;
+	}
+	memcpy(p_input, flow.src_addr, addr_len);
+	memcpy(p_input + addr_len, flow.dst_addr, addr_len);
+	*p_len = 2 * addr_len;
+	if (with_ports) {
+		memcpy(p_input + *p_len, &flow.src_port, 2);
+		memcpy(p_input + *p_len + 2, &flow.dst_port, 2);
+		*p_len += 4;
+	}
+	return true;
+}
+
+uint32_t Intel82599Dev::getRSSHash(const RSSFlow& flow) const{
+	uint8_t input[36];
+	uint32_t len;
+	if (!_getRSSInput(flow, input, &len)) {
+		return 0;
+	}
+	return toeplitzHash(m_rss_key.data(), input, len);
+}
+
+uint16_t Intel82599Dev::getRSSQueue(const RSSFlow& flow) const{
+	uint8_t input[36];
+	uint32_t len;
+	if (m_basic_para.num_rx_queues <= 1 || !_getRSSInput(flow, input, &len)) {
+		return 0;
+	}
+	uint32_t entry = toeplitzHash(m_rss_key.data(), input, len) & (RSS_RETA_SIZE - 1);
+	// the default table is only written by _initRSS, the queues take turns in it
+	return m_rss_reta_custom ? m_rss_reta[entry] : entry % std::min<uint16_t>(m_basic_para.num_rx_queues, RSS_MAX_QUEUES);
+}
+
+
+// flow type of the flow director (ixgbe_atr_flow_type) for an IPv4 protocol
+static uint8_t getFdirFlowType(uint8_t l4_proto){
+	switch (l4_proto) {
+		case IPPROTO_UDP:  return IXGBE_ATR_FLOW_TYPE_UDPV4;
+		case IPPROTO_TCP:  return IXGBE_ATR_FLOW_TYPE_TCPV4;
+		case IPPROTO_SCTP: return IXGBE_ATR_FLOW_TYPE_SCTPV4;
+		default:           return IXGBE_ATR_FLOW_TYPE_IPV4;
+	}
+}
+
+// FDIRTCPM/FDIRUDPM hold the port masks bit-reversed within each 16 bit half, set bits are ignored.
+// the masks come in network byte order like the ports they are applied to
+static uint32_t getFdirPortMask(uint16_t src_port_mask, uint16_t dst_port_mask){
+	uint32_t mask = (uint32_t) ntohs(dst_port_mask) << IXGBE_FDIRTCPM_DPORTM_SHIFT | ntohs(src_port_mask);
+	mask = ((mask & 0x55555555) << 1) | ((mask & 0xAAAAAAAA) >> 1);
+	mask = ((mask & 0x33333333) << 2) | ((mask & 0xCCCCCCCC) >> 2);
+	mask = ((mask & 0x0F0F0F0F) << 4) | ((mask & 0xF0F0F0F0) >> 4);
+	return ~(((mask & 0x00FF00FF) << 8) | ((mask & 0xFF00FF00) >> 8));
+}
+
+void Intel82599Dev::_writeFlowFilterMask(){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	// vlan, pool and flex bytes are never compared, the l4 type always
+	set_bar_reg32(bar, IXGBE_FDIRM, IXGBE_FDIRM_VLANID | IXGBE_FDIRM_VLANP | IXGBE_FDIRM_POOL | IXGBE_FDIRM_FLEX);
+	uint32_t port_mask = getFdirPortMask(m_fdir_mask.src_port, m_fdir_mask.dst_port);
+	set_bar_reg32(bar, IXGBE_FDIRTCPM, port_mask);
+	set_bar_reg32(bar, IXGBE_FDIRUDPM, port_mask);
+	set_bar_reg32(bar, IXGBE_FDIRSIP4M, ntohl(~m_fdir_mask.src_ip));
+	set_bar_reg32(bar, IXGBE_FDIRDIP4M, ntohl(~m_fdir_mask.dst_ip));
+}
+
+// perfect match mode with a 64KB table, clears all filters, see 7.1.2.7.7
+bool Intel82599Dev::_initFlowDirector(){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	uint32_t fdirctrl = IXGBE_FDIRCTRL_PBALLOC_64K | IXGBE_FDIRCTRL_PERFECT_MATCH |
+	                    IXGBE_FDIR_DROP_QUEUE << IXGBE_FDIRCTRL_DROP_Q_SHIFT | 0xA << IXGBE_FDIRCTRL_FULL_THRESH_SHIFT |
+	                    0x4 << IXGBE_FDIRCTRL_MAX_LENGTH_SHIFT;
+	_writeFlowFilterMask();
+	set_bar_reg32(bar, IXGBE_FDIRHKEY, IXGBE_ATR_BUCKET_HASH_KEY);
+	set_bar_reg32(bar, IXGBE_FDIRSKEY, IXGBE_ATR_SIGNATURE_HASH_KEY);
+	// a table initialized before has to be cleared first
+	if (get_bar_reg32(bar, IXGBE_FDIRCTRL) & IXGBE_FDIRCTRL_INIT_DONE) {
+		uint32_t fdircmd;
+		if (!_waitFdirCmd(&fdircmd)) {
+			return false;
+		}
+		set_bar_reg32(bar, IXGBE_FDIRCMD, fdircmd | IXGBE_FDIRCMD_CLEARHT);
+		set_bar_reg32(bar, IXGBE_FDIRCMD, fdircmd & ~IXGBE_FDIRCMD_CLEARHT);
+		set_bar_reg32(bar, IXGBE_FDIRHASH, 0);
+	}
+	set_bar_reg32(bar, IXGBE_FDIRCTRL, fdirctrl);
+	for (int i = 0; i < IXGBE_FDIR_INIT_DONE_POLL; i++) {
+		if (get_bar_reg32(bar, IXGBE_FDIRCTRL) & IXGBE_FDIRCTRL_INIT_DONE) {
+			m_fdir_enabled = true;
+			info("flow director initialized in perfect match mode");
+			return true;
+		}
+		usleep(1000);
+	}
+	warn("flow director initialization did not complete");
+	return false;
+}
+
+// waits until the last FDIRCMD command is executed
+bool Intel82599Dev::_waitFdirCmd(uint32_t* p_fdircmd){
+	for (int i = 0; i < IXGBE_FDIRCMD_CMD_POLL; i++) {
+		*p_fdircmd = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_FDIRCMD);
+		if (!(*p_fdircmd & IXGBE_FDIRCMD_CMD_MASK)) {
+			return true;
+		}
+		usleep(10);
+	}
+	warn("flow director command 0x%08X did not complete", *p_fdircmd);
+	return false;
+}
+
+// bucket hash of the masked filter, as ixgbe_atr_compute_perfect_hash_82599 computes it
+uint32_t Intel82599Dev::_getFlowFilterHash(const FlowFilter& filter) const{
+	union ixgbe_atr_input input = {};
+	input.formatted.flow_type = getFdirFlowType(filter.l4_proto);
+	input.formatted.src_ip[0] = filter.src_ip & m_fdir_mask.src_ip;
+	input.formatted.dst_ip[0] = filter.dst_ip & m_fdir_mask.dst_ip;
+	input.formatted.src_port = filter.src_port & m_fdir_mask.src_port;
+	input.formatted.dst_port = filter.dst_port & m_fdir_mask.dst_port;
+	uint32_t flow_vm_vlan = ntohl(input.dword_stream[0]);
+	uint32_t hi_dword = 0;
+	for (int i = 1; i <= 13; i++) {
+		hi_dword ^= input.dword_stream[i];
+	}
+	uint32_t hi_hash_dword = ntohl(hi_dword);
+	// the low dword is the word swapped common dword
+	uint32_t lo_hash_dword = (hi_hash_dword >> 16) | (hi_hash_dword << 16);
+	hi_hash_dword ^= flow_vm_vlan ^ (flow_vm_vlan >> 16);
+	uint32_t bucket_hash = 0;
+	for (int n = 0; n < 16; n++) {
+		// bit 0 of the stream is processed before the flow type goes into the low dword
+		if (n == 1) {
+			lo_hash_dword ^= flow_vm_vlan ^ (flow_vm_vlan << 16);
+		}
+		if (IXGBE_ATR_BUCKET_HASH_KEY & (1u << n)) {
+			bucket_hash ^= lo_hash_dword >> n;
+		}
+		if (IXGBE_ATR_BUCKET_HASH_KEY & (1u << (n + 16))) {
+			bucket_hash ^= hi_hash_dword >> n;
+		}
+	}
+	// at most 8K buckets
+	return bucket_hash & 0x1FFF;
+}
+
+bool Intel82599Dev::setFlowFilterMask(const FlowFilterMask& mask){
+	if (!m_flow_filters.empty()) {
+		warn("the flow filter mask cannot change while %zu filters are installed", m_flow_filters.size());
+		return false;
+	}
+	m_fdir_mask = mask;
+	if (m_fdir_enabled) {
+		_writeFlowFilterMask();
+	}
+	return true;
+}
+
+bool Intel82599Dev::addFlowFilter(const FlowFilter& filter){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	if (filter.id > FDIR_MAX_FILTER_ID || m_flow_filters.count(filter.id)) {
+		warn("flow filter id %u is out of range or in use", filter.id);
+		return false;
+	}
+	if (!filter.drop && filter.rx_queue >= m_basic_para.num_rx_queues) {
+		warn("flow filter %u steers to rx queue %u of %u", filter.id, filter.rx_queue, m_basic_para.num_rx_queues);
+		return false;
+	}
+	if (m_flow_filters.size() >= FDIR_MAX_FILTERS) {
+		warn("flow director table full (%u filters)", FDIR_MAX_FILTERS);
+		return false;
+	}
+	if (!m_fdir_enabled && !_initFlowDirector()) {
+		return false;
+	}
+	uint32_t fdircmd;
+	if (!_waitFdirCmd(&fdircmd)) {
+		return false;
+	}
+	// addresses big endian as on the wire, ports host order
+	set_bar_reg32(bar, IXGBE_FDIRIPSA, ntohl(filter.src_ip & m_fdir_mask.src_ip));
+	set_bar_reg32(bar, IXGBE_FDIRIPDA, ntohl(filter.dst_ip & m_fdir_mask.dst_ip));
+	set_bar_reg32(bar, IXGBE_FDIRPORT, (uint32_t) ntohs(filter.dst_port & m_fdir_mask.dst_port) << IXGBE_FDIRPORT_DESTINATION_SHIFT |
+	                                   ntohs(filter.src_port & m_fdir_mask.src_port));
+	set_bar_reg32(bar, IXGBE_FDIRVLAN, 0);
+	set_bar_reg32(bar, IXGBE_FDIRHASH, _getFlowFilterHash(filter) | (uint32_t) filter.id << IXGBE_FDIRHASH_SIG_SW_INDEX_SHIFT);
+	uint16_t queue = filter.drop ? IXGBE_FDIR_DROP_QUEUE : filter.rx_queue;
+	fdircmd = IXGBE_FDIRCMD_CMD_ADD_FLOW | IXGBE_FDIRCMD_FILTER_UPDATE | IXGBE_FDIRCMD_LAST | IXGBE_FDIRCMD_QUEUE_EN |
+	          (uint32_t) getFdirFlowType(filter.l4_proto) << IXGBE_FDIRCMD_FLOW_TYPE_SHIFT |
+	          (uint32_t) queue << IXGBE_FDIRCMD_RX_QUEUE_SHIFT;
+	if (filter.drop) {
+		fdircmd |= IXGBE_FDIRCMD_DROP;
+	}
+	set_bar_reg32(bar, IXGBE_FDIRCMD, fdircmd);
+	if (!_waitFdirCmd(&fdircmd)) {
+		return false;
+	}
+	m_flow_filters[filter.id] = filter;
+	return true;
+}
+
+bool Intel82599Dev::removeFlowFilter(uint16_t id){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	auto it = m_flow_filters.find(id);
+	if (it == m_flow_filters.end()) {
+		warn("no flow filter with id %u", id);
+		return false;
+	}
+	uint32_t fdirhash = _getFlowFilterHash(it->second) | (uint32_t) id << IXGBE_FDIRHASH_SIG_SW_INDEX_SHIFT;
+	uint32_t fdircmd;
+	if (!_waitFdirCmd(&fdircmd)) {
+		return false;
+	}
+	// look the filter up by bucket and id first, it is only removed if the nic has it
+	set_bar_reg32(bar, IXGBE_FDIRHASH, fdirhash);
+	set_bar_reg32(bar, IXGBE_FDIRCMD, IXGBE_FDIRCMD_CMD_QUERY_REM_FILT);
+	if (!_waitFdirCmd(&fdircmd)) {
+		return false;
+	}
+	if (fdircmd & IXGBE_FDIRCMD_FILTER_VALID) {
+		set_bar_reg32(bar, IXGBE_FDIRHASH, fdirhash);
+		set_bar_reg32(bar, IXGBE_FDIRCMD, IXGBE_FDIRCMD_CMD_REMOVE_FLOW);
+		if (!_waitFdirCmd(&fdircmd)) {
+			return false;
+		}
+	} else {
+		warn("flow filter %u was not found in the flow director table", id);
+	}
+	m_flow_filters.erase(it);
+	return true;
+}
+
+std::vector<FlowFilter> Intel82599Dev::getFlowFilters() const{
+	std::vector<FlowFilter> filters;
+	filters.reserve(m_flow_filters.size());
+	for (const auto& entry : m_flow_filters) {
+		filters.push_back(entry.second);
+	}
+	return filters;
+}
+
+
 bool Intel82599Dev::initializeInterrupt(const int interrupt_interval, const uint32_t timeout_ms){
     debug("entered Intel82599Dev::initializeInterrupt");
 	return
@@ -411,6 +1048,7 @@ bool Intel82599Dev::_getDevIRQType(){
 			continue;
 		}
 		this->m_interrupt_para.interrupt_type = i;
+		m_num_irq_vectors = irq.count;
         debug("Using IRQ type %d with %d vectors", i, irq.count);
         return true;
 	}
@@ -445,36 +1083,37 @@ int Intel82599Dev::_injectEventFdToVFIODev_msi(){
 	return event_fd;
 }
 
-int Intel82599Dev::_injectEventFdToVFIODev_msix(int index){
-	info("Enable MSIX Interrupts");
+bool Intel82599Dev::_injectEventFdsToVFIODev_msix(uint32_t num_vectors, std::vector<int>* p_event_fds){
+	info("Enable %u MSIX Interrupts", num_vectors);
 	char irq_set_buf[MSIX_IRQ_SET_BUF_LEN];
 	struct vfio_irq_set* irq_set;
 	int* fd_ptr;
 
-	// setup event fd
-	int event_fd = eventfd(0, 0);
-
+	if (!num_vectors || num_vectors > MAX_INTERRUPT_VECTORS) {
+		warn("%u MSIX vectors requested, at most %d are supported", num_vectors, MAX_INTERRUPT_VECTORS);
+		return false;
+	}
 	irq_set = reinterpret_cast<struct vfio_irq_set*>(irq_set_buf);
-	irq_set->argsz = sizeof(irq_set_buf);
-
-	if (!index) {
-		index = 1;
-	} else if (index > MAX_INTERRUPT_VECTORS)
-		index = MAX_INTERRUPT_VECTORS + 1;
-
-	irq_set->count = index;
+	irq_set->argsz = sizeof(struct vfio_irq_set) + sizeof(int) * num_vectors;
+	irq_set->count = num_vectors;
 	irq_set->flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER;
 	irq_set->index = VFIO_PCI_MSIX_IRQ_INDEX;
 	irq_set->start = 0;
+	// one event fd per vector, data holds them in vector order
 	fd_ptr = reinterpret_cast<int*>(&irq_set->data);
-	*fd_ptr = event_fd;
+	p_event_fds->clear();
+	for (uint32_t vector = 0; vector < num_vectors; vector++) {
+		// non-blocking, an event loop drains the counter only after epoll reported it
+		fd_ptr[vector] = (int) check_err(eventfd(0, EFD_NONBLOCK), "to create event fd");
+		p_event_fds->push_back(fd_ptr[vector]);
+	}
 
 	int ret = ioctl(m_fds.device_fd, VFIO_DEVICE_SET_IRQS, irq_set);
 	if (ret < 0) {
 		error("Failed to set MSIX IRQS");
-		return -1;
+		return false;
 	}
-	return event_fd;
+	return true;
 }
 
 int Intel82599Dev::_vfio_epoll_ctl(int event_fd){
@@ -496,14 +1135,32 @@ bool Intel82599Dev::_setupIRQQueues(const int interrupt_interval, const uint32_t
 	debug("entered Intel82599Dev::_setupIRQQueues");
 	switch (m_interrupt_para.interrupt_type) {	
 		case VFIO_PCI_MSIX_IRQ_INDEX: {
+			// rx queue n uses vector n, tx queue n vector num_rx_queues + n if there are enough of them
+			uint32_t max_vectors = std::min<uint32_t>(m_num_irq_vectors, MAX_INTERRUPT_VECTORS);
+			uint32_t num_vectors = m_basic_para.num_rx_queues + m_basic_para.num_tx_queues;
+			if (m_basic_para.num_rx_queues > max_vectors) {
+				warn("%u rx queues but only %u MSIX vectors", m_basic_para.num_rx_queues, max_vectors);
+				return false;
+			}
+			if (num_vectors > max_vectors) {
+				warn("%u MSIX vectors are too few for the tx queues, tx interrupts are not available", max_vectors);
+				num_vectors = m_basic_para.num_rx_queues;
+			}
+			std::vector<int> event_fds;
+			if (!_injectEventFdsToVFIODev_msix(num_vectors, &event_fds)) {
+				return false;
+			}
+			m_tx_event_fds.assign(event_fds.begin() + m_basic_para.num_rx_queues, event_fds.end());
 			for (uint32_t rx_queue = 0; rx_queue < m_basic_para.num_rx_queues; rx_queue++) {
-				int vfio_event_fd = _injectEventFdToVFIODev_msix(rx_queue);
+				int vfio_event_fd = event_fds[rx_queue];
 				int vfio_epoll_fd = _vfio_epoll_ctl(vfio_event_fd);
     			InterruptQueue   interrupt_queue;
 				interrupt_queue.vfio_event_fd = vfio_event_fd;
 				interrupt_queue.vfio_epoll_fd = vfio_epoll_fd;
-				interrupt_queue.moving_avg.length = 0;
-				interrupt_queue.moving_avg.index = 0;
+				interrupt_queue.moving_avg = {};
+				interrupt_queue.last_time_checked = _monotonic_time();
+				interrupt_queue.instr_counter = 0;
+				interrupt_queue.rx_pkts = 0;
 				interrupt_queue.interval = interrupt_interval;
 				interrupt_queue.timeout_ms = timeout_ms;
 				m_interrupt_para.interrupt_queues.push_back(interrupt_queue);
@@ -517,9 +1174,12 @@ bool Intel82599Dev::_setupIRQQueues(const int interrupt_interval, const uint32_t
     			InterruptQueue   interrupt_queue;
 				interrupt_queue.vfio_event_fd = vfio_event_fd;
 				interrupt_queue.vfio_epoll_fd = vfio_epoll_fd;
-				interrupt_queue.moving_avg.length = 0;
-				interrupt_queue.moving_avg.index = 0;
+				interrupt_queue.moving_avg = {};
+				interrupt_queue.last_time_checked = _monotonic_time();
+				interrupt_queue.instr_counter = 0;
+				interrupt_queue.rx_pkts = 0;
 				interrupt_queue.interval = interrupt_interval;
+				interrupt_queue.timeout_ms = timeout_ms;
 				m_interrupt_para.interrupt_queues.push_back(interrupt_queue);
 			}
 			break;
@@ -532,6 +1192,247 @@ bool Intel82599Dev::_setupIRQQueues(const int interrupt_interval, const uint32_t
 }
 
 
+bool Intel82599Dev::setQueueInterrupt(uint16_t queue_id, bool tx, bool enable){
+	uint8_t* bar = m_basic_para.p_bar_addr[0];
+	if (m_interrupt_para.interrupt_type != VFIO_PCI_MSIX_IRQ_INDEX) {
+		// MSI: one vector and IVAR maps every rx queue to cause 0, so the mask covers all of them
+		if (tx || queue_id >= m_basic_para.num_rx_queues) {
+			warn("no interrupt for %s queue %u with MSI", tx ? "tx" : "rx", queue_id);
+			return false;
+		}
+		if (m_basic_para.num_rx_queues > 1) {
+			warn("rx queue %u shares its MSI interrupt cause with the other queues, it cannot be masked alone", queue_id);
+			return false;
+		}
+		set_bar_reg32(bar, enable ? IXGBE_EIMS : IXGBE_EIMC, 1u << 0);
+		return true;
+	}
+	if (tx ? queue_id >= m_tx_event_fds.size() : queue_id >= m_basic_para.num_rx_queues) {
+		warn("no MSIX vector for %s queue %u", tx ? "tx" : "rx", queue_id);
+		return false;
+	}
+	uint32_t vector = tx ? m_basic_para.num_rx_queues + queue_id : queue_id;
+	// the extended registers cover all 64 vectors, EIMS/EIMC only the first 16
+	set_bar_reg32(bar, enable ? IXGBE_EIMS_EX(vector >> 5) : IXGBE_EIMC_EX(vector >> 5), 1u << (vector & 31));
+	return true;
+}
+
+int Intel82599Dev::getQueueEventFd(uint16_t queue_id, bool tx) const{
+	if (tx) {
+		return queue_id < m_tx_event_fds.size() ? m_tx_event_fds[queue_id] : -1;
+	}
+	return queue_id < m_interrupt_para.interrupt_queues.size() ? m_interrupt_para.interrupt_queues[queue_id].vfio_event_fd : -1;
+}
+
+QueueEventLoop::QueueEventLoop(){
+	m_epoll_fd = (int) check_err(epoll_create1(0), "to create epoll");
+}
+
+QueueEventLoop::~QueueEventLoop(){
+	close(m_epoll_fd);
+}
+
+bool QueueEventLoop::addQueue(Intel82599Dev* dev, uint16_t queue_id, bool tx){
+	int event_fd = dev->getQueueEventFd(queue_id, tx);
+	if (event_fd < 0) {
+		warn("%s queue %u has no interrupt event fd", tx ? "tx" : "rx", queue_id);
+		return false;
+	}
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	// the index of the source tells the queue apart when it fires
+	event.data.u32 = (uint32_t) m_sources.size();
+	if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, event_fd, &event) < 0) {
+		warn("failed to add the event fd of %s queue %u: %s", tx ? "tx" : "rx", queue_id, strerror(errno));
+		return false;
+	}
+	m_sources.push_back({dev, queue_id, tx, event_fd});
+	m_events.resize(m_sources.size());
+	return !tx || dev->setQueueInterrupt(queue_id, true, true);
+}
+
+int QueueEventLoop::wait(QueueEvent* events, int max_events, int timeout_ms){
+	int rc = epoll_wait(m_epoll_fd, m_events.data(), std::min<int>(max_events, (int) m_events.size()), timeout_ms);
+	if (rc < 0) {
+		if (errno != EINTR) {
+			warn("epoll_wait failed: %s", strerror(errno));
+		}
+		return rc;
+	}
+	for (int i = 0; i < rc; i++) {
+		const Source& source = m_sources[m_events[i].data.u32];
+		uint64_t count = 0;
+		// drains the interrupt counter, a concurrent reader may have taken it already
+		if (read(source.event_fd, &count, sizeof(count)) < 0) {
+			count = 0;
+		}
+		events[i] = {source.dev, source.queue_id, source.tx, count};
+	}
+	return rc;
+}
+
+uint16_t Intel82599Dev::receiveHybrid(uint16_t queue_id, struct pkt_buf** bufs, uint16_t batch_size){
+	if (queue_id >= p_rx_ring_buffers.size()) {
+		warn("rx queue %u out of range", queue_id);
+		return 0;
+	}
+	IXGBE_RxRingBuffer* rx_ring = p_rx_ring_buffers[queue_id];
+	if (queue_id >= m_interrupt_para.interrupt_queues.size() || !m_interrupt_para.interrupt_queues[queue_id].timeout_ms) {
+		return rx_ring->readDescriptors(batch_size, bufs);
+	}
+	InterruptQueue& irq_queue = m_interrupt_para.interrupt_queues[queue_id];
+	// no need to sleep while packets are still waiting in the ring
+	if (irq_queue.interrupt_enabled && !irq_queue.batch_full && !rx_ring->isHeadDone()) {
+		// a timeout still reads the ring, the interrupt may be throttled while packets wait
+		rx_ring->vfio_epoll_wait(irq_queue.vfio_epoll_fd, irq_queue.timeout_ms);
+	}
+	uint16_t num = rx_ring->readDescriptors(batch_size, bufs);
+	irq_queue.batch_full = (num == batch_size);
+	irq_queue.rx_pkts += num;
+	// every wakeup is worth a clock read, busy polling only checks every few bursts
+	if (irq_queue.interrupt_enabled || (irq_queue.instr_counter++ & HYBRID_CHECK_MASK) == 0) {
+		uint64_t now = _monotonic_time();
+		if (irq_queue.interrupt_enabled && m_interrupt_para.dynamic_itr) {
+			_updateDynamicITR(queue_id, now);
+		}
+		if (now - irq_queue.last_time_checked > irq_queue.interval) {
+			_updateHybridMode(queue_id, now);
+		}
+	}
+	return num;
+}
+
+void Intel82599Dev::_updateHybridMode(uint16_t queue_id, uint64_t now){
+	InterruptQueue& irq_queue = m_interrupt_para.interrupt_queues[queue_id];
+	struct interrupt_moving_avg* avg = &irq_queue.moving_avg;
+	uint64_t rate = irq_queue.rx_pkts * 1000000000ull / (now - irq_queue.last_time_checked);
+	avg->sum -= avg->measured_rates[avg->index];
+	avg->measured_rates[avg->index] = rate;
+	avg->sum += rate;
+	if (avg->length < MOVING_AVERAGE_RANGE) {
+		avg->length++;
+	}
+	avg->index = (avg->index + 1) % MOVING_AVERAGE_RANGE;
+	irq_queue.rx_pkts = 0;
+	irq_queue.last_time_checked = now;
+	uint64_t average = avg->sum / avg->length;
+	// hysteresis: between the two thresholds the queue stays in its mode
+	if (irq_queue.interrupt_enabled && average > m_interrupt_para.poll_above_pps) {
+		// the queue does not need its interrupt while polling, masking it saves the wakeups of the eventfd.
+		// a queue that cannot be masked on its own stays on interrupts
+		if (!setQueueInterrupt(queue_id, false, false)) {
+			return;
+		}
+		irq_queue.interrupt_enabled = false;
+		irq_queue.mode_switches++;
+		debug("queue %u: %lu pkts/s, busy polling", queue_id, average);
+	} else if (!irq_queue.interrupt_enabled && average < m_interrupt_para.irq_below_pps) {
+		// a frame received while masked raises the interrupt as soon as it is unmasked
+		setQueueInterrupt(queue_id, false, true);
+		irq_queue.interrupt_enabled = true;
+		irq_queue.mode_switches++;
+		debug("queue %u: %lu pkts/s, waiting for interrupts", queue_id, average);
+	}
+}
+
+// the dynamic ITR of the linux ixgbe driver (ixgbe_update_itr/ixgbe_set_itr), measured over wall time instead of
+// per interrupt since a wakeup may cover several interrupts
+void Intel82599Dev::_updateDynamicITR(uint16_t queue_id, uint64_t now){
+	struct itr_state* itr = &m_interrupt_para.interrupt_queues[queue_id].itr;
+	uint64_t elapsed_us = (now - itr->last_update) / 1000;
+	// the rate needs at least one throttling interval of traffic
+	if (elapsed_us < std::max<uint64_t>(itr->itr >> 2, ITR_MIN_WINDOW_US)) {
+		return;
+	}
+	const RxRingStats& stats = p_rx_ring_buffers[queue_id]->getStats();
+	uint64_t pkts = stats.rx_pkts - itr->rx_pkts;
+	uint64_t bytes = stats.rx_bytes - itr->rx_bytes;
+	itr->rx_pkts = stats.rx_pkts;
+	itr->rx_bytes = stats.rx_bytes;
+	itr->last_update = now;
+	if (!pkts) {
+		// nothing received, keep the setting
+		return;
+	}
+	itr->bytes_per_us = bytes / elapsed_us;
+	switch (itr->latency_range) {
+		case ITR_LOWEST_LATENCY:
+			if (itr->bytes_per_us > ITR_LOW_BYTES_PER_US) {
+				itr->latency_range = ITR_LOW_LATENCY;
+			}
+			break;
+		case ITR_LOW_LATENCY:
+			if (itr->bytes_per_us > ITR_BULK_BYTES_PER_US) {
+				itr->latency_range = ITR_BULK_LATENCY;
+			} else if (itr->bytes_per_us <= ITR_LOW_BYTES_PER_US) {
+				itr->latency_range = ITR_LOWEST_LATENCY;
+			}
+			break;
+		case ITR_BULK_LATENCY:
+			if (itr->bytes_per_us <= ITR_BULK_BYTES_PER_US) {
+				itr->latency_range = ITR_LOW_LATENCY;
+			}
+			break;
+	}
+	static const uint32_t range_itr[] = {EITR_LOWEST_LATENCY, EITR_LOW_LATENCY, EITR_BULK_LATENCY};
+	uint32_t target_itr = range_itr[itr->latency_range];
+	uint32_t new_itr = target_itr;
+	// a longer interval is approached smoothly like ixgbe_set_itr does, a shorter one is taken right away.
+	// the step is rounded up to the 2us granularity of EITR, rounding down could stall short of the target
+	if (new_itr > itr->itr && itr->itr) {
+		new_itr = (10 * new_itr * itr->itr) / (9 * new_itr + itr->itr);
+		new_itr = std::min<uint32_t>((new_itr + 7) & IXGBE_MAX_EITR, target_itr);
+	}
+	// compare what the register really holds, a change below its granularity is no change
+	if ((new_itr & IXGBE_MAX_EITR) == itr->itr) {
+		return;
+	}
+	_writeQueueITR(queue_id, new_itr);
+}
+
+void Intel82599Dev::_writeQueueITR(uint16_t queue_id, uint32_t itr){
+	struct itr_state* itr_state = &m_interrupt_para.interrupt_queues[queue_id].itr;
+	itr &= IXGBE_MAX_EITR;
+	if (itr != itr_state->itr) {
+		itr_state->changes++;
+	}
+	itr_state->itr = itr;
+	// CNT_WDIS keeps the running interval counter, the new interval applies from the next interrupt on
+	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_EITR(queue_id), itr | IXGBE_EITR_CNT_WDIS);
+}
+
+void Intel82599Dev::setDynamicITR(bool enable){
+	m_interrupt_para.dynamic_itr = enable;
+	for (uint16_t queue_id = 0; queue_id < m_interrupt_para.interrupt_queues.size(); queue_id++) {
+		struct itr_state* itr = &m_interrupt_para.interrupt_queues[queue_id].itr;
+		itr->latency_range = ITR_LOW_LATENCY;
+		itr->last_update = _monotonic_time();
+		if (queue_id < p_rx_ring_buffers.size()) {
+			itr->rx_pkts = p_rx_ring_buffers[queue_id]->getStats().rx_pkts;
+			itr->rx_bytes = p_rx_ring_buffers[queue_id]->getStats().rx_bytes;
+		}
+		_writeQueueITR(queue_id, enable ? EITR_LOW_LATENCY : m_interrupt_para.itr_rate);
+	}
+}
+
+uint32_t Intel82599Dev::getQueueITR(uint16_t queue_id) const{
+	return queue_id < m_interrupt_para.interrupt_queues.size() ? m_interrupt_para.interrupt_queues[queue_id].itr.itr : 0;
+}
+
+bool Intel82599Dev::setHybridThresholds(uint64_t poll_above_pps, uint64_t irq_below_pps){
+	if (poll_above_pps <= irq_below_pps) {
+		warn("hybrid rx needs poll_above_pps %lu > irq_below_pps %lu", poll_above_pps, irq_below_pps);
+		return false;
+	}
+	m_interrupt_para.poll_above_pps = poll_above_pps;
+	m_interrupt_para.irq_below_pps = irq_below_pps;
+	return true;
+}
+
+const InterruptQueue* Intel82599Dev::getInterruptQueue(uint16_t queue_id) const{
+	return queue_id < m_interrupt_para.interrupt_queues.size() ? &m_interrupt_para.interrupt_queues[queue_id] : nullptr;
+}
+
 uint32_t Intel82599Dev::_get_link_speed(){
 	uint32_t links = get_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_LINKS);
 	if (!(links & IXGBE_LINKS_UP)) {
@@ -606,12 +1507,12 @@ bool Intel82599Dev::_initTxDescRingRegs(){
 	return true;
 }
 // this function sends packets in [TDH, TDT).
-void Intel82599Dev::infoNIC_Tx(uint16_t tail_index){
-	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_TDT(0), tail_index);
+void Intel82599Dev::infoNIC_Tx(uint16_t tail_index, uint16_t queue_id){
+	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_TDT(queue_id), tail_index);
 }
 
-void        Intel82599Dev::infoNIC_Rx(uint16_t tail_index){
-	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_RDT(0), tail_index);
+void        Intel82599Dev::infoNIC_Rx(uint16_t tail_index, uint16_t queue_id){
+	set_bar_reg32(m_basic_para.p_bar_addr[0], IXGBE_RDT(queue_id), tail_index);
 }
 
 
@@ -653,8 +1554,12 @@ void Intel82599Dev::capturePackets(uint16_t batch_size, int64_t n_packets, std::
 		return;
 	}
 
+	// with hardware timestamps the records carry the nic clock in ns, which the nanosecond magic tells the readers.
+	// latched PTP stamps keep their precision, the batch stamps of the other packets (PKT_RX_TIMESTAMP_BATCH) are
+	// only as good as the poll interval
+	bool hw_timestamps = m_time_counter.isEnabled();
 	pcap_hdr_t header = {
-		.magic_number =  0xa1b2c3d4,
+		.magic_number = hw_timestamps ? 0xa1b23c4d : 0xa1b2c3d4,
 		.version_major = 2,
 		.version_minor = 4,
 		.thiszone = 0,
@@ -667,36 +1572,48 @@ void Intel82599Dev::capturePackets(uint16_t batch_size, int64_t n_packets, std::
 	struct pkt_buf** received_pkt = new struct pkt_buf*[batch_size];
 	struct timeval tv;
 	uint32_t received_pkt_count = 0;
-	uint16_t tail_idx;
-	int interrupt_num = 0;
 	info("capturing pkt ...");
 	while(n_packets != 0){
-		if (m_interrupt_para.interrupt_queues[0].timeout_ms){
-			interrupt_num = p_rx_ring_buffers[0]->vfio_epoll_wait(m_interrupt_para.interrupt_queues[0].vfio_epoll_fd,
-												m_interrupt_para.interrupt_queues[0].timeout_ms);
-		}
-		// Process packets if interrupt received OR if polling mode (timeout_ms == 0)
-		if (interrupt_num > 0 || !m_interrupt_para.interrupt_queues[0].timeout_ms){
-			received_pkt_count = p_rx_ring_buffers[0]->readDescriptors(batch_size,received_pkt);	
-			gettimeofday(&tv, NULL);
+		// sleeps on the interrupt while traffic is low, busy polls during bursts
+		received_pkt_count = receiveHybrid(0, received_pkt, batch_size);
+		if (received_pkt_count){
+			if (!hw_timestamps) {
+				gettimeofday(&tv, NULL);
+			}
 			for (uint32_t i = 0; i < received_pkt_count && n_packets != 0; i++) {
+					uint64_t ts = received_pkt[i]->timestamp;
 					pcaprec_hdr_t rec_header = {
-						.ts_sec = (uint32_t)tv.tv_sec,
-						.ts_usec = (uint32_t)tv.tv_usec,
-						.incl_len = received_pkt[i]->size,
-						.orig_len = received_pkt[i]->size
+						.ts_sec = hw_timestamps ? (uint32_t) (ts / 1000000000ull) : (uint32_t) tv.tv_sec,
+						.ts_usec = hw_timestamps ? (uint32_t) (ts % 1000000000ull) : (uint32_t) tv.tv_usec,
+						.incl_len = received_pkt[i]->pkt_len,
+						.orig_len = received_pkt[i]->pkt_len
 					};
 					fwrite(&rec_header, sizeof(pcaprec_hdr_t), 1, pcap);
 
-					fwrite(received_pkt[i]->data, received_pkt[i]->size, 1, pcap);
+					// a jumbo frame is spread over a chain of pkt_bufs
+					for (struct pkt_buf* seg = received_pkt[i]; seg; seg = seg->next) {
+						fwrite(seg->getData(), seg->size, 1, pcap);
+					}
 					// n_packets == -1 indicates unbounded capture
 					if (n_packets > 0) {
 						n_packets--;
 					}
 			}
 			p_rx_ring_buffers[0]->releasePktBufs(received_pkt,received_pkt_count);
-			tail_idx = p_rx_ring_buffers[0]->fillDescRing(received_pkt_count);
-			infoNIC_Rx(tail_idx);
+			// refills and rings the doorbell only once rx_free_thresh descriptors are consumed, a chained packet
+			// counts with all of its descriptors
+			p_rx_ring_buffers[0]->refillDescRing();
+		}
+	}
+	const RxRingStats& rx_stats = p_rx_ring_buffers[0]->getStats();
+	info("received %lu packets with %lu RDT writes (%.3f per packet)", rx_stats.rx_pkts, rx_stats.doorbells,
+	     rx_stats.rx_pkts ? (double) rx_stats.doorbells / rx_stats.rx_pkts : 0.0);
+	if (const InterruptQueue* irq_queue = getInterruptQueue(0)) {
+		info("hybrid rx switched %lu times between interrupts and polling, ended %s", irq_queue->mode_switches,
+		     irq_queue->interrupt_enabled ? "on interrupts" : "polling");
+		if (m_interrupt_para.dynamic_itr) {
+			info("dynamic ITR ended at EITR 0x%03x (%lu bytes/us) after %lu changes", irq_queue->itr.itr,
+			     irq_queue->itr.bytes_per_us, irq_queue->itr.changes);
 		}
 	}
 	fclose(pcap);
@@ -2,6 +2,9 @@
 #include "../common/basic_dev.h"
 #include <cstdint>
 #include <vector>
+#include <array>
+#include <map>
+#include <sys/epoll.h>
 #include "../common/memory_pool.h"
 #include "ixgbe_ring_buffer.h"
 
@@ -12,6 +15,58 @@
 #define wrap_ring(index, ring_size) (uint16_t) ((index + 1) & (ring_size - 1))
 #endif
 
+#define RSS_KEY_SIZE 40 // bytes of the Toeplitz key in RSSRK
+#define RSS_RETA_SIZE 128 // entries of the redirection table, indexed by the low 7 bits of the hash
+#define RSS_MAX_QUEUES 16 // queues a RETA entry can point to
+#define RSS_FIELDS_DEFAULT (IXGBE_MRQC_RSS_FIELD_IPV4 | IXGBE_MRQC_RSS_FIELD_IPV4_TCP | IXGBE_MRQC_RSS_FIELD_IPV4_UDP | \
+                            IXGBE_MRQC_RSS_FIELD_IPV6 | IXGBE_MRQC_RSS_FIELD_IPV6_TCP | IXGBE_MRQC_RSS_FIELD_IPV6_UDP)
+
+// a flow as the RSS hash sees it, addresses and ports in network byte order
+struct RSSFlow {
+    bool                    ipv6{false};
+    uint8_t                 l4_proto{0};    // IPPROTO_TCP, IPPROTO_UDP, anything else hashes the addresses only
+    uint8_t                 src_addr[16]{}; // the first 4 bytes for IPv4
+    uint8_t                 dst_addr[16]{};
+    uint16_t                src_port{0};
+    uint16_t                dst_port{0};
+};
+
+// EITR per latency range of the dynamic interrupt throttling and the byte rates between the ranges
+#define EITR_LOWEST_LATENCY 0x000 // no throttling, the interrupt follows the write-back
+#define EITR_LOW_LATENCY 0x028 // 10us, ~100k interrupts/s
+#define EITR_BULK_LATENCY 0x150 // 84us, ~12k interrupts/s
+#define ITR_LOW_BYTES_PER_US 10
+#define ITR_BULK_BYTES_PER_US 20
+#define ITR_MIN_WINDOW_US 100 // shortest time a rate is measured over, shorter windows only see single bursts
+
+#define RX_HDR_SPLIT_SIZE 256 // default header buffer, enough for ethernet + VLAN + IPv6 + TCP with options
+#define PTP_ETHERTYPE 0x88F7 // IEEE 1588 over ethernet, latched by the L2 timestamp filters
+
+#define FDIR_MAX_FILTERS 2046 // perfect filters in the 64KB flow director table, (1024 << PBALLOC) - 2
+#define FDIR_MAX_FILTER_ID 0x7FFF // software index in FDIRHASH
+
+// an IPv4 flow the flow director steers to one rx queue or drops, addresses and ports in network byte order
+struct FlowFilter {
+    uint16_t                id{0};          // chosen by the caller, unique per device
+    uint8_t                 l4_proto{0};    // IPPROTO_UDP, IPPROTO_TCP or IPPROTO_SCTP, 0 for any other IPv4 packet
+    uint32_t                src_ip{0};
+    uint32_t                dst_ip{0};
+    uint16_t                src_port{0};
+    uint16_t                dst_port{0};
+    uint16_t                rx_queue{0};
+    bool                    drop{false};    // drop matching packets instead of receiving them
+};
+
+// fields every filter is compared on, a clear bit matches anything. one mask for all filters of a device,
+// e.g. dst_ip and dst_port only to steer multicast groups regardless of the sender. network byte order like the
+// FlowFilter fields they are ANDed with, e.g. htons(0xFF00) for the high byte of a port
+struct FlowFilterMask {
+    uint32_t                src_ip{0xFFFFFFFF};
+    uint32_t                dst_ip{0xFFFFFFFF};
+    uint16_t                src_port{0xFFFF};
+    uint16_t                dst_port{0xFFFF};
+};
+
 struct QueuesPtr {
     void*                   rx;
     void*                   tx;
@@ -19,9 +74,42 @@ struct QueuesPtr {
     
 
 
+class Intel82599Dev;
+
+// an interrupt reported by QueueEventLoop::wait
+struct QueueEvent {
+    Intel82599Dev*          dev;
+    uint16_t                queue_id;
+    bool                    tx;
+    uint64_t                count;          // interrupts of the queue since it was drained last
+};
+
+// one epoll instance over the MSI-X event fds of any number of queues, of one or several devices, e.g. all
+// queues a thread serves. not thread-safe, one loop per thread
+class QueueEventLoop {
+    public:
+                    QueueEventLoop()                                                                        ;
+                    ~QueueEventLoop()                                                                       ;
+        // a tx queue gets its interrupt unmasked, rx queues are enabled by enableDevInterrupt
+        bool        addQueue(Intel82599Dev* dev, uint16_t queue_id, bool tx = false)                        ;
+        // waits up to timeout_ms (-1 forever) for interrupts, returns the number of events stored,
+        // 0 on timeout and -1 on error
+        int         wait(QueueEvent* events, int max_events, int timeout_ms)                                ;
+    private:
+        struct Source {
+            Intel82599Dev*      dev;
+            uint16_t            queue_id;
+            bool                tx;
+            int                 event_fd;
+        };
+        int                             m_epoll_fd{-1}                                     ;
+        std::vector<Source>             m_sources                                          ;
+        std::vector<struct epoll_event> m_events                                           ;
+};
+
 class Intel82599Dev : public BasicDev{
     public:
-        Intel82599Dev(std::string pci_addr, uint8_t max_bar_index);
+        Intel82599Dev(std::string pci_addr, uint8_t max_bar_index, int container_fd = -1);
         ~Intel82599Dev();
         bool        initHardware()                override;
         bool        initializeInterrupt(const int interrupt_interval, const uint32_t timeout_ms)        override;
@@ -32,9 +120,93 @@ class Intel82599Dev : public BasicDev{
         bool        sendOnQueue(uint8_t* p_data, size_t size, uint16_t queue_id)                     override;
         void        loopSendTest(uint32_t num_buf);
         void        capturePackets(uint16_t batch_size,int64_t n_packets, std::string file_name);
-        void        infoNIC_Tx(uint16_t tail_index);
-        void        infoNIC_Rx(uint16_t tail_index);
+        // one rx burst of queue_id in hybrid mode: waits for the interrupt of the queue while its packet rate is low,
+        // busy polls while it is high. without an interrupt timeout the queue is always polled. switching needs the
+        // queue's own interrupt, with MSI that is only the case for a single rx queue, otherwise it stays on interrupts
+        uint16_t    receiveHybrid(uint16_t queue_id, struct pkt_buf** bufs, uint16_t batch_size)            ;
+        // moving average packet rates in packets/s above which a queue switches to busy polling and below which
+        // it goes back to interrupts, poll_above_pps > irq_below_pps
+        bool        setHybridThresholds(uint64_t poll_above_pps, uint64_t irq_below_pps)                   ;
+        // masks (enable = false) or unmasks the MSI-X vector of a queue, with MSI only the rx queue of a single
+        // queue setup can be masked since IVAR maps all rx queues to one cause
+        bool        setQueueInterrupt(uint16_t queue_id, bool tx, bool enable)                              ;
+        // event fd the vector of a queue signals, -1 if it has none
+        int         getQueueEventFd(uint16_t queue_id, bool tx = false) const                               ;
+        // adaptive interrupt moderation: while a queue waits for interrupts its EITR follows the measured byte
+        // rate through the latency ranges of ITR_*_LATENCY. off restores itr_rate on all queues
+        void        setDynamicITR(bool enable)                                                             ;
+        // current EITR value of a queue as written to the nic
+        uint32_t    getQueueITR(uint16_t queue_id) const                                                    ;
+        // interrupt state of a queue: mode (interrupt_enabled), moving average, switches, dynamic ITR.
+        // nullptr if unknown
+        const InterruptQueue* getInterruptQueue(uint16_t queue_id) const                                    ;
+        void        infoNIC_Tx(uint16_t tail_index, uint16_t queue_id = 0);
+        void        infoNIC_Rx(uint16_t tail_index, uint16_t queue_id = 0);
         bool        setPromisc(bool enable)                             override;
+        // largest frame accepted incl. CRC, above 1518 bytes jumbo frames are enabled. frames larger than the data
+        // room of a pkt_buf are received as chains, so the pools can keep their 2KB buffers
+        bool        setMaxFrameSize(uint32_t max_frame_size)                                                ;
+        // RSS over all rx queues (at most 16), on by default with more than one queue. rss_fields are
+        // IXGBE_MRQC_RSS_FIELD_* flags, 0 turns RSS off. an empty key keeps the current one (the well-known
+        // Microsoft key by default), otherwise it has RSS_KEY_SIZE bytes. applied right away if the rx rings exist,
+        // otherwise by enableDevQueues
+        bool        setRSS(uint32_t rss_fields = RSS_FIELDS_DEFAULT, const std::vector<uint8_t>& key = {})   ;
+        // RSS_RETA_SIZE queue ids, by default the queues take turns
+        bool        setRSSRedirection(const std::vector<uint8_t>& reta)                                     ;
+        // hash and queue the nic computes for a flow with the current fields, key and RETA. a flow none of the
+        // fields apply to is not hashed and lands on queue 0
+        uint32_t    getRSSHash(const RSSFlow& flow) const                                                   ;
+        uint16_t    getRSSQueue(const RSSFlow& flow) const                                                  ;
+        // flow director perfect filters, matching packets bypass RSS. the mask can only change while no filter
+        // is installed, the first filter initializes the flow director
+        bool        setFlowFilterMask(const FlowFilterMask& mask)                                           ;
+        bool        addFlowFilter(const FlowFilter& filter)                                                 ;
+        bool        removeFlowFilter(uint16_t id)                                                           ;
+        std::vector<FlowFilter> getFlowFilters() const                                                      ;
+        // Toeplitz hash of len bytes (at most RSS_KEY_SIZE - 4) as specified for RSS
+        static uint32_t toeplitzHash(const uint8_t* key, const uint8_t* data, uint32_t len)                 ;
+        // writes the RSS_KEY_SIZE byte key, the RSS_RETA_SIZE entry table and the hash fields into the registers
+        // of bar and turns RSS on, no checks
+        static void     writeRSSRegs(uint8_t* bar, uint32_t rss_fields, const uint8_t* key, const uint8_t* reta)  ;
+        // warm start: lock all process memory and fault in (optionally zero) every DMA byte before the queues start,
+        // call it before setRxRingBuffers/setTxRingBuffers so the rings are faulted in and locked as well
+        void        setWarmStart(bool enable, bool pre_zero = false)                                       ;
+        // backs the DMA memory of the device with files under the hugetlbfs mount dir (e.g. /mnt/huge), named after
+        // the PCI address, so a restarted process re-attaches to its rings and pools. call it before setRx/TxRingBuffers
+        bool        setFileBacking(const std::string& dir)                                                  ;
+        // makes the pkt_buf pools of all queues thread-safe (see DMAMemoryPool::setThreadSafe), so the core that
+        // receives can hand pkt_bufs to worker cores which free them back into the rx pool themselves.
+        // call it before setRxRingBuffers/setTxRingBuffers, the pools then get room for the caches of num_threads
+        // threads on top of the ring. more threads than that can drain the pool, the ring then refills short
+        void        setThreadSafePools(bool enable, uint32_t num_threads = 2,
+                                       uint32_t cache_size = PKT_BUF_CACHE_SIZE)                            ;
+        DMAMemoryPool* getRxMemPool(uint16_t queue_id) const                                                ;
+        // consumed descriptors an rx queue collects before it is refilled and RDT is written, for all queues
+        bool        setRxFreeThresh(uint16_t rx_free_thresh)                                                ;
+        // packets, refilled descriptors and doorbells of an rx queue, nullptr for an unknown queue
+        const RxRingStats* getRxRingStats(uint16_t queue_id) const                                          ;
+        // strips the VLAN tag of received frames into pkt_buf::vlan_tci (RXDCTL.VME), for all queues
+        void        setVlanStrip(bool enable)                                                               ;
+        // IEEE 1588 clock of the nic: SYSTIM runs with the TIMINCA of the current link speed (call it once the link
+        // is up) and is anchored to the wall clock. every received packet gets the nic clock of its batch
+        // (PKT_RX_TIMESTAMP with PKT_RX_TIMESTAMP_BATCH), PTP packets of rx_filter (IXGBE_TSYNCRXCTL_TYPE_*) their own
+        // latched stamp
+        bool        enableTimestamping(uint32_t rx_filter = IXGBE_TSYNCRXCTL_TYPE_L2_L4_V2)                  ;
+        void        disableTimestamping()                                                                   ;
+        bool        isTimestamping() const                      { return m_time_counter.isEnabled(); }
+        // nic clock in ns since the epoch, 0 if timestamping is off
+        uint64_t    getHwTime()                                                                             ;
+        // send time of the last packet sent with PKT_TX_IEEE1588_TMST, false if none was latched since the last call
+        bool        readTxTimestamp(uint64_t* p_ns)                                                         ;
+        // header split for the rx rings created afterwards by setRxRingBuffers: the L2-L4 headers of every frame go
+        // into a pkt_buf of hdr_size bytes (a multiple of 64, at most 1024) from a dense per-queue header pool, the
+        // payload into the packet pool, see PKT_RX_HDR_SPLIT. 0 turns it off
+        bool        setHeaderSplit(uint16_t hdr_size = RX_HDR_SPLIT_SIZE)                                  ;
+        // headroom of the pkt_bufs of pools created afterwards by setRxRingBuffers/setTxRingBuffers
+        void        setPktBufHeadroom(uint16_t headroom)          { m_pkt_buf_headroom = headroom; }
+        // port id reported in pkt_buf::port of every received packet
+        void        setPortId(uint16_t port_id)                                                             ;
+        DMAMemoryPool* getTxMemPool(uint16_t queue_id) const                                                ;
         bool        wait4Link()                                         override;
     private:
         // _getFD() and _getBARAddr() are now inherited from BasicDev
@@ -53,20 +225,62 @@ class Intel82599Dev : public BasicDev{
         bool        _initTxDescRingRegs();
         bool        _enableDevRxQueue();
         bool        _enableDevTxQueue();
+        bool        _releaseRxRingBuffers();
+        bool        _releaseTxRingBuffers();
+        uint32_t    _getPoolSize(uint32_t num_desc) const;
+        void        _warmDMAMemory();
         void        _enableDevMSIInterrupt(uint16_t queue_id)                              ;
         void        _enableDevMSIxInterrupt(uint16_t queue_id)                             ;
         uint32_t    _get_link_speed()                                                      ;
+        bool        _initRSS()                                                             ;
+        bool        _getRSSInput(const RSSFlow& flow, uint8_t* p_input, uint32_t* p_len) const ;
+        bool        _initFlowDirector()                                                    ;
+        void        _writeFlowFilterMask()                                                 ;
+        uint32_t    _getFlowFilterHash(const FlowFilter& filter) const                     ;
+        bool        _waitFdirCmd(uint32_t* p_fdircmd)                                      ;
         bool        _getDevIRQType()                                                       ;
         bool        _setupIRQQueues(const int interrupt_interval, const uint32_t timeout_ms);
         int         _injectEventFdToVFIODev_msi()                                          ;
-        int         _injectEventFdToVFIODev_msix(int index)                                ;
+        // one event fd per vector, in vector order
+        bool        _injectEventFdsToVFIODev_msix(uint32_t num_vectors, std::vector<int>* p_event_fds);
         int         _vfio_epoll_ctl(int event_fd)                                          ;
+        void        _updateHybridMode(uint16_t queue_id, uint64_t now)                     ;
+        void        _updateDynamicITR(uint16_t queue_id, uint64_t now)                     ;
+        void        _writeQueueITR(uint16_t queue_id, uint32_t itr)                        ;
         uint16_t    _calc_ip_checksum  (uint8_t* data, uint32_t len)                       ;
     private:
         uint32_t                        m_num_rx_bufs{0}                                   ;   
         uint32_t                        m_buf_rx_size{0}                                   ;
         uint32_t                        m_num_tx_bufs{0}                                   ;
         uint32_t                        m_buf_tx_size{0}                                   ;
+        bool                            m_warm_start{false}                                ;
+        bool                            m_warm_pre_zero{false}                             ;
+        bool                            m_thread_safe_pools{false}                         ;
+        // threads expected to share a pool, each may hold a cache of m_pool_cache_size pkt_bufs
+        uint32_t                        m_pool_threads{2}                                  ;
+        uint32_t                        m_pool_cache_size{PKT_BUF_CACHE_SIZE}              ;
+        uint16_t                        m_pkt_buf_headroom{PKT_BUF_HEADROOM}               ;
+        uint16_t                        m_port_id{0}                                       ;
+        uint16_t                        m_rx_free_thresh{RX_FREE_THRESH}                   ;
+        bool                            m_vlan_strip{false}                                ;
+        uint16_t                        m_hdr_split_size{0}                                ;
+        // vectors VFIO offers for the interrupt type in use
+        uint32_t                        m_num_irq_vectors{0}                               ;
+        // event fds of the tx queue vectors, empty if they did not fit
+        std::vector<int>                m_tx_event_fds                                     ;
+        // nic clock of getHwTime/readTxTimestamp, every rx ring has its own copy
+        IXGBE_TimeCounter               m_time_counter                                     ;
+        // the RXSTMPL/H latch is one per device, the rings of all queues take turns reading it
+        std::mutex                      m_rx_stamp_lock                                    ;
+        uint32_t                        m_rss_fields{RSS_FIELDS_DEFAULT}                   ;
+        std::array<uint8_t, RSS_KEY_SIZE> m_rss_key                                        ;
+        std::array<uint8_t, RSS_RETA_SIZE> m_rss_reta{}                                    ;
+        // RETA set by setRSSRedirection instead of spreading over all queues
+        bool                            m_rss_reta_custom{false}                           ;
+        bool                            m_fdir_enabled{false}                              ;
+        FlowFilterMask                  m_fdir_mask                                        ;
+        // installed flow director filters by id
+        std::map<uint16_t, FlowFilter>  m_flow_filters                                     ;
         // std::vector<DMAMemoryPool*>        p_mempool                                          ;
         DMAMemoryPool*                    p_tx_mempool{nullptr}                              ;
         std::vector<IXGBE_RxRingBuffer*>  p_rx_ring_buffers                                  ;